@@ -0,0 +1,414 @@
+//mybench: throughput of mylib vs stdio vs raw read/write
+//
+//  build: gcc -O2 -pthread -o mybench mybench.c tabexpand.c mylib.c
+//  usage: ./mybench [-s MB] [-d DIR] [-r reps] [-b sizes] [-w workloads]
+//
+//generates a tab-heavy text file of -s MB (default 64) in DIR
+//(default /tmp) and runs each workload over it with each implementation, for every
+//buffer size in -b (comma list, 0 = library default; default
+//0,4096,65536,1048576), with the page cache hot and then cold. workloads:
+//  copy  bulk copy (myfpeek/myfwrite, fread/fwrite, read/write)
+//  getc  one byte at a time (myfgetc/myfputc, getc/putc; no raw version)
+//  tabs  tabstop's four-space expansion: mylib runs tabstop's own
+//        expand_tabs (myfpeek + SIMD scan, input mapped at bufsiz 0 like
+//        tabstop), stdio and raw a byte at a time
+//reports the best of -r runs: MB/s of input, syscalls (myfstats for
+//mylib, /proc/self/io for the others) and cycles per byte (x86 only)
+#define _POSIX_C_SOURCE 200809L
+#include "mylib.h"
+#include "tabexpand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#define COPY_CHUNK (64 * 1024) //user buffer for fread/fwrite
+
+struct result {
+    unsigned long long syscalls;
+    int have_syscalls;
+};
+
+typedef int (*bench_fn)(const char *in, const char *out, int bufsiz, struct result *r);
+
+static unsigned long long cycles_now(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//read+write syscalls so far from /proc/self/io, or -1 if there's no such file
+static long long proc_syscalls(void)
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return -1;
+    char line[128];
+    long long total = 0, v;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscr: %lld", &v) == 1 || sscanf(line, "syscw: %lld", &v) == 1)
+            total += v;
+    }
+    fclose(f);
+    return total;
+}
+
+static MYSTREAM *my_open(const char *path, const char *mode, int bufsiz)
+{
+    return (bufsiz > 0) ? myfopen_ex(path, mode, bufsiz) : myfopen(path, mode);
+}
+
+//adds the syscalls s made to r, then closes it
+static int my_close(MYSTREAM *s, struct result *r)
+{
+    struct mystats st;
+    if (myfstats(s, &st) == 0) {
+        r->syscalls += st.reads + st.writes + st.seeks;
+        r->have_syscalls = 1;
+    }
+    return myfclose(s);
+}
+
+//glibc ignores the size given to setvbuf without a buffer, so pass one.
+//*bufp is for the caller to free after fclose
+static FILE *std_open(const char *path, const char *mode, int bufsiz, char **bufp)
+{
+    *bufp = NULL;
+    FILE *f = fopen(path, mode);
+    if (!f || bufsiz <= 0) return f;
+    *bufp = (char*)malloc((size_t)bufsiz);
+    if (!*bufp || setvbuf(f, *bufp, _IOFBF, (size_t)bufsiz) != 0) {
+        fclose(f);
+        free(*bufp);
+        *bufp = NULL;
+        return NULL;
+    }
+    return f;
+}
+
+//---- copy ----
+
+static int copy_mylib(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    MYSTREAM *a = my_open(in, "r", bufsiz), *b = my_open(out, "w", bufsiz);
+    int rc = (a && b) ? 0 : -1;
+    size_t n;
+    const unsigned char *p;
+    while (rc == 0 && (p = myfpeek(a, &n)) != NULL) {
+        if (myfwrite(p, n, b) < 0) rc = -1;
+        myfskip(a, n);
+    }
+    if (rc == 0 && errno != 0) rc = -1;
+    if (a) my_close(a, r);
+    if (b && my_close(b, r) < 0) rc = -1;
+    return rc;
+}
+
+static int copy_stdio(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    (void)r;
+    char *abuf, *bbuf;
+    FILE *a = std_open(in, "r", bufsiz, &abuf), *b = std_open(out, "w", bufsiz, &bbuf);
+    static char chunk[COPY_CHUNK];
+    int rc = (a && b) ? 0 : -1;
+    size_t n;
+    while (rc == 0 && (n = fread(chunk, 1, sizeof(chunk), a)) > 0) {
+        if (fwrite(chunk, 1, n, b) != n) rc = -1;
+    }
+    if (a) { if (ferror(a)) rc = -1; fclose(a); }
+    if (b && fclose(b) != 0) rc = -1;
+    free(abuf); free(bbuf);
+    return rc;
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        if (w == 0) { errno = EIO; return -1; } //no progress, don't spin
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int copy_raw(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    (void)r;
+    size_t sz = (bufsiz > 0) ? (size_t)bufsiz : COPY_CHUNK;
+    char *buf = (char*)malloc(sz);
+    int a = open(in, O_RDONLY), b = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int rc = (buf && a >= 0 && b >= 0) ? 0 : -1;
+    ssize_t n;
+    while (rc == 0 && (n = read(a, buf, sz)) != 0) {
+        if (n < 0) { if (errno != EINTR) rc = -1; continue; }
+        if (write_all(b, buf, (size_t)n) < 0) rc = -1;
+    }
+    if (a >= 0) close(a);
+    if (b >= 0 && close(b) < 0) rc = -1;
+    free(buf);
+    return rc;
+}
+
+//---- getc ----
+
+static int getc_mylib(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    MYSTREAM *a = my_open(in, "r", bufsiz), *b = my_open(out, "w", bufsiz);
+    int rc = (a && b) ? 0 : -1;
+    int c;
+    while (rc == 0 && (c = myfgetc(a)) != -1) {
+        if (myfputc(c, b) < 0) rc = -1;
+    }
+    if (rc == 0 && errno != 0) rc = -1;
+    if (a) my_close(a, r);
+    if (b && my_close(b, r) < 0) rc = -1;
+    return rc;
+}
+
+static int getc_stdio(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    (void)r;
+    char *abuf, *bbuf;
+    FILE *a = std_open(in, "r", bufsiz, &abuf), *b = std_open(out, "w", bufsiz, &bbuf);
+    int rc = (a && b) ? 0 : -1;
+    int c;
+    while (rc == 0 && (c = getc(a)) != EOF) {
+        if (putc(c, b) == EOF) rc = -1;
+    }
+    if (a) { if (ferror(a)) rc = -1; fclose(a); }
+    if (b && fclose(b) != 0) rc = -1;
+    free(abuf); free(bbuf);
+    return rc;
+}
+
+//---- tabs ----
+
+//opens the streams the way tabstop's convert() does
+static int tabs_mylib(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    static const struct tabspec fixed = { 0, 0, NULL, 0 };
+    MYSTREAM *a = my_open(in, (bufsiz > 0) ? "r" : "rm", bufsiz), *b = my_open(out, "w", bufsiz);
+    int rc = (a && b) ? 0 : -1;
+    if (rc == 0 && expand_tabs(a, b, &fixed) != EXPAND_OK) rc = -1;
+    if (a) my_close(a, r);
+    if (b && my_close(b, r) < 0) rc = -1;
+    return rc;
+}
+
+static int tabs_stdio(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    (void)r;
+    char *abuf, *bbuf;
+    FILE *a = std_open(in, "r", bufsiz, &abuf), *b = std_open(out, "w", bufsiz, &bbuf);
+    int rc = (a && b) ? 0 : -1;
+    int c;
+    while (rc == 0 && (c = getc(a)) != EOF) {
+        if (c == '\t') {
+            if (fputs("    ", b) == EOF) rc = -1;
+        } else if (putc(c, b) == EOF) {
+            rc = -1;
+        }
+    }
+    if (a) { if (ferror(a)) rc = -1; fclose(a); }
+    if (b && fclose(b) != 0) rc = -1;
+    free(abuf); free(bbuf);
+    return rc;
+}
+
+static int tabs_raw(const char *in, const char *out, int bufsiz, struct result *r)
+{
+    (void)r;
+    size_t sz = (bufsiz > 0) ? (size_t)bufsiz : COPY_CHUNK;
+    char *buf = (char*)malloc(sz), *obuf = (char*)malloc(sz * 4);
+    int a = open(in, O_RDONLY), b = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int rc = (buf && obuf && a >= 0 && b >= 0) ? 0 : -1;
+    ssize_t n;
+    while (rc == 0 && (n = read(a, buf, sz)) != 0) {
+        if (n < 0) { if (errno != EINTR) rc = -1; continue; }
+        char *o = obuf;
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\t') { memcpy(o, "    ", 4); o += 4; }
+            else *o++ = buf[i];
+        }
+        if (write_all(b, obuf, (size_t)(o - obuf)) < 0) rc = -1;
+    }
+    if (a >= 0) close(a);
+    if (b >= 0 && close(b) < 0) rc = -1;
+    free(buf); free(obuf);
+    return rc;
+}
+
+static const struct workload {
+    const char *name;
+    bench_fn fn[3]; //mylib, stdio, raw (NULL: not measured)
+} workloads[] = {
+    { "copy", { copy_mylib, copy_stdio, copy_raw } },
+    { "getc", { getc_mylib, getc_stdio, NULL } },
+    { "tabs", { tabs_mylib, tabs_stdio, tabs_raw } },
+};
+static const char *impl_names[3] = { "mylib", "stdio", "raw" };
+
+//---- setup ----
+
+//tab-separated lines of short fields, roughly what tabstop gets fed
+static int make_input(const char *path, size_t size)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    unsigned x = 12345;
+    size_t done = 0;
+    while (done < size) {
+        x = x * 1103515245u + 12345u;
+        int len = (int)((x >> 16) % 12);
+        for (int i = 0; i < len; i++) putc('a' + (int)((x >> (i + 8)) % 26), f);
+        int sep = ((x >> 28) % 6 == 0) ? '\n' : '\t';
+        putc(sep, f);
+        done += (size_t)len + 1;
+    }
+    int rc = (fflush(f) == 0 && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    return rc;
+}
+
+//cold: drop the input from the page cache. hot: read it all once
+static void prepare_cache(const char *path, int cold)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    if (cold) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    } else {
+        static char buf[1 << 16];
+        while (read(fd, buf, sizeof(buf)) > 0) {}
+    }
+    close(fd);
+}
+
+static int parse_sizes(const char *s, int *sizes, int max)
+{
+    int n = 0;
+    while (*s && n < max) {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 0 || v > 1 << 26 || (*end != ',' && *end != '\0')) return -1;
+        sizes[n++] = (int)v;
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+//a whole positive number no bigger than max, or -1
+static long parse_count(const char *s, long max)
+{
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno || v < 1 || v > max) return -1;
+    return v;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s MB] [-d DIR] [-r reps] [-b size,...] [-w copy,getc,tabs]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    long mb = 64;
+    int reps = 1;
+    const char *dir = "/tmp";
+    const char *wanted = NULL;
+    int sizes[32] = { 0, 4096, 65536, 1048576 };
+    int nsizes = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:r:b:w:")) != -1) {
+        switch (opt) {
+        case 's': mb = parse_count(optarg, 1L << 20); break;
+        case 'd': dir = optarg; break;
+        case 'r': reps = (int)parse_count(optarg, 1000000); break;
+        case 'b': nsizes = parse_sizes(optarg, sizes, 32); break;
+        case 'w': wanted = optarg; break;
+        default: usage(argv[0]); return 255;
+        }
+    }
+    if (mb <= 0 || reps <= 0 || nsizes <= 0 || optind != argc) { usage(argv[0]); return 255; }
+    tabexpand_init();
+
+    char in[4096], out[4096];
+    snprintf(in, sizeof(in), "%s/mybench.in.%ld", dir, (long)getpid());
+    snprintf(out, sizeof(out), "%s/mybench.out.%ld", dir, (long)getpid());
+    size_t size = (size_t)mb << 20;
+    if (make_input(in, size) < 0) { fprintf(stderr, "make input '%s': %s\n", in, strerror(errno)); return 255; }
+    struct stat st;
+    if (stat(in, &st) == 0) size = (size_t)st.st_size;
+
+    printf("%-5s %-5s %-4s %8s %10s %12s %8s\n",
+           "work", "impl", "pc", "bufsiz", "MB/s", "syscalls", "cyc/B");
+    int failed = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if (wanted && !strstr(wanted, workloads[w].name)) continue;
+        for (int cold = 0; cold <= 1; cold++) {
+            for (int si = 0; si < nsizes; si++) {
+                for (int impl = 0; impl < 3; impl++) {
+                    bench_fn fn = workloads[w].fn[impl];
+                    if (!fn) continue;
+                    double best = 0;
+                    unsigned long long best_cyc = 0;
+                    struct result res = { 0, 0 };
+                    long long sys = -1;
+                    for (int rep = 0; rep < reps; rep++) {
+                        prepare_cache(in, cold);
+                        struct result r = { 0, 0 };
+                        long long s0 = proc_syscalls();
+                        unsigned long long c0 = cycles_now();
+                        double t0 = now_sec();
+                        int rc = fn(in, out, sizes[si], &r);
+                        double t = now_sec() - t0;
+                        unsigned long long c = cycles_now() - c0;
+                        long long s1 = proc_syscalls();
+                        unlink(out);
+                        if (rc < 0) { perror(workloads[w].name); failed = 1; break; }
+                        if (best == 0 || t < best) {
+                            best = t; best_cyc = c; res = r;
+                            sys = (s0 >= 0 && s1 >= 0) ? s1 - s0 : -1;
+                        }
+                    }
+                    if (best == 0) continue;
+
+                    char sysbuf[32] = "-", cycbuf[32] = "-";
+                    if (res.have_syscalls) snprintf(sysbuf, sizeof(sysbuf), "%llu", res.syscalls);
+                    else if (sys >= 0) snprintf(sysbuf, sizeof(sysbuf), "%lld", sys);
+#ifdef HAVE_RDTSC
+                    snprintf(cycbuf, sizeof(cycbuf), "%.2f", (double)best_cyc / (double)size);
+#endif
+                    printf("%-5s %-5s %-4s %8d %10.1f %12s %8s\n",
+                           workloads[w].name, impl_names[impl], cold ? "cold" : "hot",
+                           sizes[si], (double)size / (1 << 20) / best, sysbuf, cycbuf);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    unlink(in);
+    return failed ? 255 : 0;
+}
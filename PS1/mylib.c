@@ -1,57 +1,569 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE //madvise(MADV_HUGEPAGE)
 #include "mylib.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #ifndef BUFSIZ
 #define BUFSIZ 4096
 #endif
 
+//buffer sizing when the caller doesn't pass one (bufsiz <= 0)
+#define MY_FILE_BUF   (128u << 10)  //floor for regular files/block devices
+#define MY_PIPE_BUF   (64u << 10)   //default Linux pipe capacity
+#define MY_MAX_BUF    (8u << 20)    //auto-sized buffers stop growing here
+#define MY_GROW_AFTER 4             //full reads/flushes in a row before doubling
+#define MY_HUGE_PAGE  (2u << 20)    //buffers this big get hugepage alignment
+
 
 enum { MY_READ = 0, MY_WRITE = 1 };
 
-struct MYSTREAM {
+//stream flags
+#define MYF_CAN_READ  0x01
+#define MYF_CAN_WRITE 0x02
+#define MYF_APPEND    0x04  //"a"/"a+": the kernel puts every write at EOF
+#define MYF_WANT_MMAP 0x08  //"rm": try to map the file instead of read()ing it
+#define MYF_MAPPED    0x10  //buf is an mmap of the whole file, not malloc'd
+#define MYF_PREFETCH  0x20  //"rp": read ahead on a helper thread
+#define MYF_GROW      0x40  //buffer was auto-sized and may double under load
+#define MYF_TRACE     0x80  //MYLIB_STATS is set: time syscalls, report at close
+#define MYF_LOCKED    0x100 //"l": stream carries its own lock
+#define MYF_OWNBUF    0x200 //buf is its own allocation, not the inline one
+
+//the stream header and (if it's small enough) its buffer share one
+//cache-line aligned block, the buffer starting on the line after the header
+#define MY_CACHELINE 64
+#define MY_HDR_SIZE  ((sizeof(MYSTREAM) + MY_CACHELINE - 1) & ~(size_t)(MY_CACHELINE - 1))
+
+//idle streams a pool holds on to; any more are freed on close
+#define MY_POOL_KEEP 256
+
+struct MYPOOL {
+    pthread_mutex_t lock;
+    MYSTREAM *free_list;    //linked through pool_next
+    int nfree;
+    int bufsiz;
+};
+
+//read-ahead buffers kept by the helper thread on top of the one being consumed
+#define MY_PREFETCH_DEPTH 2
+
+//read-ahead state for "rp" streams. The helper thread owns the fd offset
+//and fills slots in ring order; the consumer swaps a full slot's buffer
+//with its own drained one, so no data is ever copied between them.
+struct my_prefetch {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct {
+        unsigned char *buf;
+        ssize_t len;    //bytes read, 0 at EOF, -1 on error
+        int err;
+    } slot[MY_PREFETCH_DEPTH];
+    int head;           //oldest full slot
+    int count;          //full slots waiting for the consumer
+    int done;           //helper saw EOF or an error and stopped reading
+    int busy;           //helper is inside read() right now
+    int stop;           //myfclose wants the helper gone
     int fd;
-    int mode;
-    unsigned char *buf;
     size_t cap;
-    size_t pos;
-    size_t len;
-    int eof;
+    struct mystats *stats;  //the stream's counters, only touched under lock
+    int timing;
+};
+
+//"l" streams: recursive, so a thread holding myflockfile() can still call
+//the locking entry points
+struct my_lock {
+    pthread_mutex_t m;
 };
 
+#define LOCK(s)   do { if ((s)->lock) pthread_mutex_lock(&(s)->lock->m); } while (0)
+#define UNLOCK(s) do { if ((s)->lock) pthread_mutex_unlock(&(s)->lock->m); } while (0)
+
 //helpers
-static int parse_mode(const char *mode, int *out)
+
+//MYLIB_STATS=1 in the environment turns on syscall timing and a
+//per-stream summary on stderr at myfclose; counters are always kept
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static int stats_env = 0;
+
+static void read_stats_env(void)
+{
+    const char *e = getenv("MYLIB_STATS");
+    stats_env = (e && *e && strcmp(e, "0") != 0);
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//every syscall on the stream's fd goes through one of these so the
+//counters in s->stats stay honest
+static ssize_t sys_read(MYSTREAM *s, void *buf, size_t n)
+{
+    long long t0 = (s->flags & MYF_TRACE) ? now_ns() : 0;
+    ssize_t r = read(s->fd, buf, n);
+    if (s->flags & MYF_TRACE) s->stats.read_ns += (unsigned long long)(now_ns() - t0);
+    s->stats.reads++;
+    if (r > 0) s->stats.bytes_read += (unsigned long long)r;
+    return r;
+}
+
+static ssize_t sys_write(MYSTREAM *s, const void *buf, size_t n)
+{
+    long long t0 = (s->flags & MYF_TRACE) ? now_ns() : 0;
+    ssize_t w = write(s->fd, buf, n);
+    if (s->flags & MYF_TRACE) s->stats.write_ns += (unsigned long long)(now_ns() - t0);
+    s->stats.writes++;
+    if (w > 0) s->stats.bytes_written += (unsigned long long)w;
+    if (w >= 0 && (size_t)w < n) s->stats.short_writes++;
+    return w;
+}
+
+static ssize_t sys_writev(MYSTREAM *s, const struct iovec *v, int cnt)
+{
+    size_t want = 0;
+    for (int i = 0; i < cnt; i++) want += v[i].iov_len;
+
+    long long t0 = (s->flags & MYF_TRACE) ? now_ns() : 0;
+    ssize_t w = writev(s->fd, v, cnt);
+    if (s->flags & MYF_TRACE) s->stats.write_ns += (unsigned long long)(now_ns() - t0);
+    s->stats.writes++;
+    if (w > 0) s->stats.bytes_written += (unsigned long long)w;
+    if (w >= 0 && (size_t)w < want) s->stats.short_writes++;
+    return w;
+}
+
+static off_t sys_lseek(MYSTREAM *s, off_t off, int whence)
+{
+    s->stats.seeks++;
+    return lseek(s->fd, off, whence);
+}
+
+//*out gets the direction the stream starts in, *flags what it may do;
+//*oflags is what open() needs for it
+static int parse_mode(const char *mode, int *out, int *flags, int *oflags)
 {
     if (!mode || !*mode) { errno = EINVAL; return -1; }
-    if (mode[0] == 'r' && mode[1] == '\0') { *out = MY_READ;  return 0; }
-    if (mode[0] == 'w' && mode[1] == '\0') { *out = MY_WRITE; return 0; }
-    errno = EINVAL;
-    return -1;
+    switch (mode[0]) {
+        case 'r': *out = MY_READ;  *flags = MYF_CAN_READ;  *oflags = 0;                  break;
+        case 'w': *out = MY_WRITE; *flags = MYF_CAN_WRITE; *oflags = O_CREAT | O_TRUNC;  break;
+        case 'a': *out = MY_WRITE; *flags = MYF_CAN_WRITE | MYF_APPEND;
+                  *oflags = O_CREAT | O_APPEND; break;
+        default: errno = EINVAL; return -1;
+    }
+    for (const char *p = mode + 1; *p; p++) {
+        if (*p == '+') *flags |= MYF_CAN_READ | MYF_CAN_WRITE;
+        else if (*p == 'm') *flags |= MYF_WANT_MMAP;
+        else if (*p == 'p') *flags |= MYF_PREFETCH;
+        else if (*p == 'l') *flags |= MYF_LOCKED;
+        else if (*p == 'b') continue; //no text/binary distinction here
+        else { errno = EINVAL; return -1; }
+    }
+    //mapping and read-ahead only make sense for read-only streams
+    if ((*flags & (MYF_WANT_MMAP | MYF_PREFETCH)) && (*flags & MYF_CAN_WRITE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((*flags & MYF_CAN_READ) && (*flags & MYF_CAN_WRITE)) *oflags |= O_RDWR;
+    else if (*flags & MYF_CAN_WRITE) *oflags |= O_WRONLY;
+    else *oflags |= O_RDONLY;
+    return 0;
 }
 
-static MYSTREAM *alloc_stream(int fd, int mode, int bufsiz)
+//buffers big enough for transparent hugepages are aligned to one so the
+//kernel can actually back them with one
+static unsigned char *alloc_buf(size_t size)
 {
-    if (bufsiz <= 0) bufsiz = BUFSIZ;
+    if (size < MY_HUGE_PAGE) return (unsigned char*)malloc(size);
 
-    MYSTREAM *s = (MYSTREAM*)malloc(sizeof(*s));
-    if (!s) return NULL;
+    void *p;
+    if (posix_memalign(&p, MY_HUGE_PAGE, size) != 0) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return (unsigned char*)p;
+}
+
+//pick a buffer size from what the fd actually is; st is NULL if fstat failed
+static size_t pick_bufsiz(const struct stat *st, int *growable)
+{
+    *growable = 0;
+    if (!st) return BUFSIZ;
 
-    s->buf = (unsigned char*)malloc((size_t)bufsiz);
-    if (!s->buf) { free(s); return NULL; }
+    if (S_ISREG(st->st_mode) || S_ISBLK(st->st_mode)) {
+        //a whole number of the filesystem's preferred blocks (NFS and
+        //friends report large ones), but never less than MY_FILE_BUF
+        size_t blk = (st->st_blksize > 0) ? (size_t)st->st_blksize : BUFSIZ;
+        size_t n = (MY_FILE_BUF + blk - 1) / blk * blk;
+        if (n > MY_MAX_BUF) n = blk;
+        *growable = 1;
+        return n;
+    }
+    if (S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode)) {
+        *growable = 1;
+        return MY_PIPE_BUF;
+    }
+    //ttys and other character devices: no point holding output back longer
+    return BUFSIZ;
+}
+
+//called while the buffer is empty: after MY_GROW_AFTER full reads or
+//full flushes in a row the buffer is too small for this fd, so double it
+static void maybe_grow(MYSTREAM *s)
+{
+    if (!(s->flags & MYF_GROW)) return;
+    if (s->full_runs < MY_GROW_AFTER || s->cap >= MY_MAX_BUF) return;
+
+    unsigned char *nb = alloc_buf(s->cap * 2);
+    if (!nb) return; //keep going with what we have
+    if (s->flags & MYF_OWNBUF) free(s->buf);
+    s->buf = nb;
+    s->flags |= MYF_OWNBUF;
+    s->cap *= 2;
+    if (s->mode == MY_WRITE) s->wcap = s->cap;
+    s->full_runs = 0;
+}
+
+static int mappable(const struct stat *st)
+{
+    if (!st || !S_ISREG(st->st_mode) || st->st_size <= 0) return 0;
+    return (unsigned long long)st->st_size <= (size_t)-1 / 2;
+}
+
+//map a regular file read-only so buf/len cover all of it; anything that
+//isn't a non-empty regular file (pipes, ttys, sockets...) returns -1 and
+//the caller falls back to the read() buffer
+static int map_stream(MYSTREAM *s, const struct stat *st)
+{
+    if (!mappable(st)) return -1;
+
+    //myfdopen may hand us an fd that was already read from
+    off_t cur = sys_lseek(s, 0, SEEK_CUR);
+    if (cur < 0) return -1;
+
+    size_t size = (size_t)st->st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+    if (p == MAP_FAILED) return -1;
+    posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+
+    s->buf = (unsigned char*)p;
+    s->cap = size;
+    s->len = size;
+    s->pos = ((size_t)cur < size) ? (size_t)cur : size;
+    s->off = 0;
+    s->flags |= MYF_MAPPED;
+    return 0;
+}
+
+static void *prefetch_main(void *arg)
+{
+    struct my_prefetch *pf = (struct my_prefetch*)arg;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        while (!pf->stop && (pf->done || pf->count == MY_PREFETCH_DEPTH))
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        if (pf->stop) break;
+
+        //the consumer never touches slots outside [head, head+count)
+        int i = (pf->head + pf->count) % MY_PREFETCH_DEPTH;
+        unsigned char *dst = pf->slot[i].buf;
+        pf->busy = 1;
+        pthread_mutex_unlock(&pf->lock);
+
+        long long t0 = pf->timing ? now_ns() : 0;
+        ssize_t n;
+        int calls = 0;
+        do {
+            n = read(pf->fd, dst, pf->cap);
+            calls++;
+        } while (n < 0 && errno == EINTR);
+        int err = errno;
+        long long t1 = pf->timing ? now_ns() : 0;
+
+        pthread_mutex_lock(&pf->lock);
+        pf->busy = 0;
+        pf->stats->reads += (unsigned long long)calls;
+        if (n > 0) pf->stats->bytes_read += (unsigned long long)n;
+        pf->stats->read_ns += (unsigned long long)(t1 - t0);
+        pf->slot[i].len = n;
+        pf->slot[i].err = err;
+        pf->count++;
+        if (n <= 0) pf->done = 1;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void free_prefetch(struct my_prefetch *pf)
+{
+    for (int i = 0; i < MY_PREFETCH_DEPTH; i++) free(pf->slot[i].buf);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    free(pf);
+}
+
+//start the read-ahead thread. Only done for regular files: their reads
+//always complete, so myfclose can join the helper without hanging on a
+//pipe or tty that never delivers. Returns -1 to fall back to plain reads.
+static int start_prefetch(MYSTREAM *s, const struct stat *st)
+{
+    if (!st || !S_ISREG(st->st_mode)) return -1;
+
+    struct my_prefetch *pf = (struct my_prefetch*)calloc(1, sizeof(*pf));
+    if (!pf) return -1;
+    for (int i = 0; i < MY_PREFETCH_DEPTH; i++) {
+        pf->slot[i].buf = alloc_buf(s->cap);
+        if (!pf->slot[i].buf) { free_prefetch(pf); return -1; }
+    }
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->fd  = s->fd;
+    pf->cap = s->cap;
+    pf->stats  = &s->stats;
+    pf->timing = (s->flags & MYF_TRACE) != 0;
+
+    //let the kernel's own readahead know what we're up to as well
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (pthread_create(&pf->tid, NULL, prefetch_main, pf) != 0) {
+        free_prefetch(pf);
+        return -1;
+    }
+    s->pf = pf;
+    return 0;
+}
+
+static void stop_prefetch(MYSTREAM *s)
+{
+    struct my_prefetch *pf = s->pf;
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->tid, NULL);
+    free_prefetch(pf);
+    s->pf = NULL;
+}
+
+//throw away everything read ahead and restart the helper at target
+static int reset_prefetch(MYSTREAM *s, off_t target)
+{
+    struct my_prefetch *pf = s->pf;
+    int rc = 0;
+
+    pthread_mutex_lock(&pf->lock);
+    while (pf->busy)
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    pf->stats->seeks++;
+    if (lseek(pf->fd, target, SEEK_SET) < 0) {
+        rc = -1;
+    } else {
+        pf->head  = 0;
+        pf->count = 0;
+        pf->done  = 0;
+    }
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return rc;
+}
+
+//swap the oldest read-ahead buffer in as the stream buffer
+static ssize_t take_prefetched(MYSTREAM *s)
+{
+    struct my_prefetch *pf = s->pf;
 
-    s->fd   = fd;
-    s->mode = mode;
-    s->cap  = (size_t)bufsiz;
+    pthread_mutex_lock(&pf->lock);
+    while (pf->count == 0 && !pf->done)
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    if (pf->count == 0) {
+        //EOF or error was already handed out
+        pthread_mutex_unlock(&pf->lock);
+        s->eof = 1;
+        return 0;
+    }
+
+    int i = pf->head;
+    ssize_t n = pf->slot[i].len;
+    int err = pf->slot[i].err;
+    if (n > 0) {
+        unsigned char *tmp = pf->slot[i].buf;
+        pf->slot[i].buf = s->buf;
+        s->buf = tmp;
+    }
+    pf->head = (pf->head + 1) % MY_PREFETCH_DEPTH;
+    pf->count--;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    if (n == 0) { s->eof = 1; return 0; }
+    if (n < 0) { errno = err; return -1; }
+    s->len = (size_t)n;
+    s->pos = 0;
+    return n;
+}
+
+static struct my_lock *new_lock(void)
+{
+    struct my_lock *l = (struct my_lock*)malloc(sizeof(*l));
+    if (!l) return NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    int rc = pthread_mutex_init(&l->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) { free(l); errno = rc; return NULL; }
+    return l;
+}
+
+static MYSTREAM *new_block(size_t icap)
+{
+    void *p;
+    if (posix_memalign(&p, MY_CACHELINE, MY_HDR_SIZE + icap) != 0) { errno = ENOMEM; return NULL; }
+
+    MYSTREAM *s = (MYSTREAM*)p;
+    s->icap  = icap;
+    s->pool  = NULL;
+    s->pool_next = NULL;
+    s->buf   = NULL;
+    s->flags = 0;
+    s->lock  = NULL;
+    s->pf    = NULL;
+    return s;
+}
+
+static void pool_put(MYSTREAM *s)
+{
+    MYPOOL *p = s->pool;
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree < MY_POOL_KEEP) {
+        s->pool_next = p->free_list;
+        p->free_list = s;
+        p->nfree++;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(s);
+}
+
+static void free_block(MYSTREAM *s)
+{
+    if (s->pool) pool_put(s);
+    else free(s);
+}
+
+//set up a fresh (or recycled) block for fd; bufsiz <= 0 means pick one.
+//On failure nothing is left allocated except the block itself.
+static int init_stream(MYSTREAM *s, int fd, int mode, int flags, int bufsiz,
+                       const struct stat *st)
+{
+    pthread_once(&stats_once, read_stats_env);
+    memset(&s->stats, 0, sizeof(s->stats));
+    if (stats_env) flags |= MYF_TRACE;
+
+    s->fd    = fd;
+    s->mode  = mode;
+    s->flags = flags;
+    s->eof   = 0;
+    s->pf    = NULL;
+    s->lock  = NULL;
+    s->full_runs = 0;
+
+    if ((flags & MYF_LOCKED) && !(s->lock = new_lock())) return -1;
+
+    //offset of buf[0] in the file, so seeks inside the buffer need no syscall
+    s->off = sys_lseek(s, 0, SEEK_CUR);
+    if (s->off < 0) s->off = 0; //pipes etc: just count bytes from here
+
+    if ((flags & MYF_WANT_MMAP) && mode == MY_READ && map_stream(s, st) == 0) {
+        s->wcap = 0;
+        return 0;
+    }
+
+    size_t size = (size_t)bufsiz;
+    if (bufsiz <= 0) {
+        int growable;
+        size = pick_bufsiz(st, &growable);
+        //read-ahead slots are swapped with buf, so they all must stay one size
+        if (growable && !(flags & MYF_PREFETCH)) s->flags |= MYF_GROW;
+    }
+
+    //read-ahead swaps buf with heap slots, so it can't use the inline one
+    if (size <= s->icap && !(flags & MYF_PREFETCH)) {
+        s->buf = (unsigned char*)s + MY_HDR_SIZE;
+    } else {
+        s->buf = alloc_buf(size);
+        if (!s->buf) {
+            if (s->lock) { pthread_mutex_destroy(&s->lock->m); free(s->lock); s->lock = NULL; }
+            return -1;
+        }
+        s->flags |= MYF_OWNBUF;
+    }
+
+    s->cap  = size;
+    s->wcap = (mode == MY_WRITE) ? s->cap : 0;
     s->pos  = 0;
     s->len  = 0;
-    s->eof  = 0;
+
+    if ((flags & MYF_PREFETCH) && mode == MY_READ && start_prefetch(s, st) < 0)
+        s->flags &= ~MYF_PREFETCH;
+    return 0;
+}
+
+//undo init_stream; the fd is the caller's business
+static void release_stream(MYSTREAM *s)
+{
+    if (s->pf) stop_prefetch(s);
+    if (s->lock) {
+        pthread_mutex_destroy(&s->lock->m);
+        free(s->lock);
+        s->lock = NULL;
+    }
+    if (s->flags & MYF_MAPPED) munmap(s->buf, s->cap);
+    else if (s->flags & MYF_OWNBUF) free(s->buf);
+    s->buf = NULL;
+    s->flags = 0;
+}
+
+static MYSTREAM *alloc_stream(int fd, int mode, int flags, int bufsiz)
+{
+    struct stat stbuf;
+    const struct stat *st = (fstat(fd, &stbuf) == 0) ? &stbuf : NULL;
+
+    //size the inline buffer for what init_stream is going to want
+    size_t icap = 0;
+    if (!((flags & MYF_WANT_MMAP) && mode == MY_READ && mappable(st)) && !(flags & MYF_PREFETCH)) {
+        int growable;
+        icap = (bufsiz > 0) ? (size_t)bufsiz : pick_bufsiz(st, &growable);
+        if (icap >= MY_HUGE_PAGE) icap = 0; //those get their own aligned allocation
+    }
+
+    MYSTREAM *s = new_block(icap);
+    if (!s) return NULL;
+    if (init_stream(s, fd, mode, flags, bufsiz, st) < 0) {
+        int saved = errno;
+        free(s);
+        errno = saved;
+        return NULL;
+    }
     return s;
 }
 
@@ -59,106 +571,748 @@ static MYSTREAM *alloc_stream(int fd, int mode, int bufsiz)
 
 MYSTREAM *myfopen_ex(const char *pathname, const char *mode, int bufsiz)
 {
-    int m;
-    if (parse_mode(mode, &m) < 0) return NULL;
+    int m, sflags, oflags;
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return NULL;
 
-    int flags, fd;
-    if (m == MY_READ) {
-        flags = O_RDONLY;
-        fd = open(pathname, flags);
-    } else {
-        flags = O_WRONLY | O_CREAT | O_TRUNC;
-        fd = open(pathname, flags, 0666);
-    }
+    int fd = open(pathname, oflags, 0666);
     if (fd < 0) return NULL;
 
-    MYSTREAM *s = alloc_stream(fd, m, bufsiz);
+    MYSTREAM *s = alloc_stream(fd, m, sflags, bufsiz);
     if (!s) { int saved = errno; close(fd); errno = saved; return NULL; }
     return s;
 }
 
 MYSTREAM *myfdopen_ex(int fd, const char *mode, int bufsiz)
 {
-    int m;
-    if (parse_mode(mode, &m) < 0) return NULL;
+    int m, sflags, oflags;
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return NULL;
 
-    MYSTREAM *s = alloc_stream(fd, m, bufsiz);
+    MYSTREAM *s = alloc_stream(fd, m, sflags, bufsiz);
     if (!s) return NULL;
     return s;
 }
 
-//Problem 3 required API (wrappers to _ex using default BUFSIZ)
+//Problem 3 required API (wrappers to _ex with the buffer sized from the fd)
 
 MYSTREAM *myfopen(const char *pathname, const char *mode)
 {
-    return myfopen_ex(pathname, mode, BUFSIZ);
+    return myfopen_ex(pathname, mode, 0);
 }
 MYSTREAM *myfdopen(int filedesc, const char *mode)
 {
-    return myfdopen_ex(filedesc, mode, BUFSIZ);
+    return myfdopen_ex(filedesc, mode, 0);
+}
+
+//refill an empty read buffer: >0 bytes now buffered, 0 at EOF, -1 on error
+static ssize_t fill_read_buffer(MYSTREAM *s)
+{
+    if (s->flags & MYF_MAPPED) { s->eof = 1; return 0; } //the whole file was already in buf
+
+    //everything up to the end of the old buffer has been consumed
+    s->off += (off_t)s->len;
+    s->pos = 0;
+    s->len = 0;
+    maybe_grow(s);
+
+    s->stats.refills++;
+    if (s->pf) return take_prefetched(s);
+    ssize_t n = sys_read(s, s->buf, s->cap);
+    if (n == 0) { s->eof = 1; return 0; }
+    if (n < 0) return -1;
+    s->len = (size_t)n;
+    if ((size_t)n == s->cap) s->full_runs++; else s->full_runs = 0;
+    return n;
+}
+
+static int flush_write_buffer(MYSTREAM *s);
+
+//drop unread buffered bytes and put the kernel offset back where the
+//caller actually is, so the next write or read lands in the right place
+static int discard_read_buffer(MYSTREAM *s)
+{
+    if (s->flags & MYF_MAPPED) return 0;
+
+    off_t logical = s->off + (off_t)s->pos;
+    if (s->pf) {
+        if (reset_prefetch(s, logical) < 0) return -1;
+    } else if (s->pos < s->len) {
+        //can't give bytes back to a pipe; nothing better to do than carry on
+        if (sys_lseek(s, logical, SEEK_SET) < 0 && errno != ESPIPE) return -1;
+    }
+    s->off = logical;
+    s->pos = 0;
+    s->len = 0;
+    return 0;
+}
+
+//"+" streams flip direction on demand; the macros always land here on the
+//first call after a switch because len is 0 while writing and wcap is 0
+//while reading
+static int switch_to_read(MYSTREAM *s)
+{
+    if (!(s->flags & MYF_CAN_READ)) { errno = EBADF; return -1; }
+    if (flush_write_buffer(s) < 0) return -1;
+    if (s->flags & MYF_APPEND) {
+        off_t cur = sys_lseek(s, 0, SEEK_CUR); //writes went to EOF, not to off
+        if (cur >= 0) s->off = cur;
+    }
+    s->mode = MY_READ;
+    s->wcap = 0;
+    s->pos  = 0;
+    s->len  = 0;
+    s->eof  = 0;
+    return 0;
+}
+
+static int switch_to_write(MYSTREAM *s)
+{
+    if (!(s->flags & MYF_CAN_WRITE)) { errno = EBADF; return -1; }
+    if (discard_read_buffer(s) < 0) return -1;
+    s->mode = MY_WRITE;
+    s->wcap = s->cap;
+    s->eof  = 0;
+    return 0;
 }
 
-int myfgetc(MYSTREAM *s)
+int (myfgetc_unlocked)(MYSTREAM *s)
 {
     if (!s) { errno = EINVAL; return -1; }
-    if (s->mode != MY_READ) { errno = EBADF; return -1; }
+    if (s->mode != MY_READ && switch_to_read(s) < 0) return -1;
 
     if (s->eof) { errno = 0; return -1; }
 
     if (s->pos >= s->len) {
-
-        ssize_t n = read(s->fd, s->buf, s->cap);
-        if (n == 0) { s->eof = 1; errno = 0; return -1; }
+        ssize_t n = fill_read_buffer(s);
+        if (n == 0) { errno = 0; return -1; }
         if (n < 0) {return -1; }
-        s->len = (size_t)n;
-        s->pos = 0;
     }
 
     return (int)s->buf[s->pos++];
 }
 
-static int flush_write_buffer(MYSTREAM *s)
+ssize_t myfread_unlocked(void *ptr, size_t n, MYSTREAM *s)
 {
-    size_t to_write = s->pos;
-    if (to_write == 0) return 0;
+    if (!s || (!ptr && n)) { errno = EINVAL; return -1; }
+    if (s->mode != MY_READ && switch_to_read(s) < 0) return -1;
 
-    ssize_t n = write(s->fd, s->buf, to_write);
-    if (n < 0) {
-        return -1;
+    unsigned char *dst = (unsigned char*)ptr;
+    size_t got = 0;
+
+    while (got < n) {
+        size_t avail = s->len - s->pos;
+        if (avail > 0) {
+            size_t k = (n - got < avail) ? n - got : avail;
+            memcpy(dst + got, s->buf + s->pos, k);
+            s->pos += k;
+            got += k;
+            continue;
+        }
+        if (s->eof) break;
+
+        ssize_t r;
+        if (n - got >= s->cap && !(s->flags & MYF_MAPPED) && !s->pf) {
+            //buffer is empty and the rest won't fit anyway: read straight into the caller
+            s->off += (off_t)s->len;
+            s->pos = 0;
+            s->len = 0;
+            r = sys_read(s, dst + got, n - got);
+            if (r > 0) { s->off += r; got += (size_t)r; continue; }
+            if (r == 0) s->eof = 1;
+        } else {
+            r = fill_read_buffer(s);
+        }
+        if (r == 0) break;
+        if (r < 0) {
+            if (got > 0) break; //hand back what we have, error shows up on the next call
+            return -1;
+        }
     }
-    if ((size_t)n != to_write) {
-        errno = EIO;
-        return -1;
+
+    if (got == 0) errno = 0;
+    return (ssize_t)got;
+}
+
+const unsigned char *myfpeek(MYSTREAM *s, size_t *avail)
+{
+    if (!s || !avail) { errno = EINVAL; return NULL; }
+    if (s->mode != MY_READ && switch_to_read(s) < 0) return NULL;
+
+    if (s->pos >= s->len) {
+        if (s->eof) { errno = 0; return NULL; }
+        ssize_t r = fill_read_buffer(s);
+        if (r == 0) { errno = 0; return NULL; }
+        if (r < 0) return NULL;
     }
-    s->pos = 0;
+    *avail = s->len - s->pos;
+    return s->buf + s->pos;
+}
+
+int myfskip(MYSTREAM *s, size_t n)
+{
+    if (!s || s->mode != MY_READ || n > s->len - s->pos) { errno = EINVAL; return -1; }
+    s->pos += n;
+    return 0;
+}
+
+char *myfgets_unlocked(char *dst, int size, MYSTREAM *s)
+{
+    if (!s || !dst || size <= 0) { errno = EINVAL; return NULL; }
+    if (s->mode != MY_READ && switch_to_read(s) < 0) return NULL;
+
+    size_t room = (size_t)size - 1;
+    size_t got = 0;
+
+    while (got < room) {
+        if (s->pos >= s->len) {
+            if (s->eof) break;
+            ssize_t r = fill_read_buffer(s);
+            if (r == 0) break;
+            if (r < 0) {
+                if (got > 0) break;
+                return NULL;
+            }
+        }
+
+        size_t avail = s->len - s->pos;
+        size_t k = (room - got < avail) ? room - got : avail;
+        unsigned char *nl = (unsigned char*)memchr(s->buf + s->pos, '\n', k);
+        if (nl) k = (size_t)(nl - (s->buf + s->pos)) + 1;
+
+        memcpy(dst + got, s->buf + s->pos, k);
+        s->pos += k;
+        got += k;
+        if (nl) break;
+    }
+
+    dst[got] = '\0';
+    if (got == 0 && room > 0) { errno = 0; return NULL; } //EOF
+    return dst;
+}
+
+//keep calling write() until all n bytes are out; pipes and sockets can
+//take less than asked for, and a signal can interrupt us midway.
+//*done gets the number of bytes actually written either way.
+static int write_all(MYSTREAM *s, const unsigned char *src, size_t n, size_t *done)
+{
+    size_t off = 0;
+    int rc = 0;
+    while (off < n) {
+        ssize_t w = sys_write(s, src + off, n - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (w == 0) { errno = EIO; rc = -1; break; } //no progress, don't spin
+        off += (size_t)w;
+    }
+    *done = off;
+    return rc;
+}
+
+//same thing for a gather list; v is advanced in place as bytes go out
+static int writev_all(MYSTREAM *s, struct iovec *v, int cnt, size_t *done)
+{
+    size_t total = 0;
+    int first = 0;
+    int rc = 0;
+
+    while (first < cnt) {
+        ssize_t w = sys_writev(s, v + first, cnt - first);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (w == 0) { errno = EIO; rc = -1; break; }
+        total += (size_t)w;
+
+        size_t left = (size_t)w;
+        while (first < cnt && left >= v[first].iov_len) {
+            left -= v[first].iov_len;
+            first++;
+        }
+        if (left > 0) {
+            v[first].iov_base = (char*)v[first].iov_base + left;
+            v[first].iov_len -= left;
+        }
+    }
+    *done = total;
+    return rc;
+}
+
+//drop the first n bytes of the write buffer after a partial flush so a
+//retry doesn't send them twice
+static void consume_write_buffer(MYSTREAM *s, size_t n)
+{
+    if (n >= s->pos) { s->pos = 0; return; }
+    memmove(s->buf, s->buf + n, s->pos - n);
+    s->pos -= n;
+}
+
+static int flush_write_buffer(MYSTREAM *s)
+{
+    if (s->pos == 0) return 0;
+
+    size_t done;
+    int was_full = (s->pos == s->cap);
+    int rc = write_all(s, s->buf, s->pos, &done);
+    consume_write_buffer(s, done);
+    s->off += (off_t)done;
+    if (rc < 0) return rc;
+
+    if (was_full) s->full_runs++; else s->full_runs = 0;
+    maybe_grow(s);
     return 0;
 }
 
-int myfputc(int c, MYSTREAM *s)
+//write n bytes from src without going through the buffer
+static int write_direct(MYSTREAM *s, const unsigned char *src, size_t n)
+{
+    size_t done;
+    int rc = write_all(s, src, n, &done);
+    s->off += (off_t)done;
+    return rc;
+}
+
+ssize_t myfwrite_unlocked(const void *ptr, size_t n, MYSTREAM *s)
+{
+    if (!s || (!ptr && n)) { errno = EINVAL; return -1; }
+    if (s->mode != MY_WRITE && switch_to_write(s) < 0) return -1;
+
+    const unsigned char *src = (const unsigned char*)ptr;
+    size_t left = n;
+
+    while (left > 0) {
+        if (s->pos == 0 && left >= s->cap) {
+            //nothing buffered and at least a full buffer's worth: one write() for all of it
+            if (write_direct(s, src, left) < 0) return -1;
+            break;
+        }
+        size_t room = s->cap - s->pos;
+        size_t k = (left < room) ? left : room;
+        memcpy(s->buf + s->pos, src, k);
+        s->pos += k;
+        src += k;
+        left -= k;
+
+        if (s->pos == s->cap) {
+            if (flush_write_buffer(s) < 0) return -1;
+        }
+    }
+    return (ssize_t)n;
+}
+
+//how many iovecs we hand the kernel per writev(), well under IOV_MAX
+#define MY_IOV_BATCH 64
+
+ssize_t myfwritev_unlocked(const struct iovec *iov, int iovcnt, MYSTREAM *s)
+{
+    if (!s || iovcnt < 0 || (!iov && iovcnt)) { errno = EINVAL; return -1; }
+    if (s->mode != MY_WRITE && switch_to_write(s) < 0) return -1;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    //small records just get appended to the buffer like myfwrite would
+    if (total <= s->cap - s->pos) {
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(s->buf + s->pos, iov[i].iov_base, iov[i].iov_len);
+            s->pos += iov[i].iov_len;
+        }
+        return (ssize_t)total;
+    }
+
+    //otherwise send whatever is buffered plus the caller's spans in one writev()
+    struct iovec v[MY_IOV_BATCH];
+    int i = 0;
+    while (i < iovcnt || s->pos > 0) {
+        int k = 0;
+        size_t buffered = s->pos;
+        if (buffered > 0) {
+            v[k].iov_base = s->buf;
+            v[k].iov_len  = buffered;
+            k++;
+        }
+        while (k < MY_IOV_BATCH && i < iovcnt) {
+            if (iov[i].iov_len > 0) v[k++] = iov[i];
+            i++;
+        }
+
+        size_t done;
+        int rc = writev_all(s, v, k, &done);
+        consume_write_buffer(s, done);
+        s->off += (off_t)done;
+        if (rc < 0) return -1;
+    }
+    return (ssize_t)total;
+}
+
+int (myfputc_unlocked)(int c, MYSTREAM *s)
 {
     if (!s) { errno = EINVAL; return -1; }
-    if (s->mode != MY_WRITE) { errno = EBADF; return -1; }
+    if (s->mode != MY_WRITE && switch_to_write(s) < 0) return -1;
 
+    //the macro fast path fills buf right up to cap without flushing
+    if (s->pos >= s->cap) {
+        if (flush_write_buffer(s) < 0) return -1;
+    }
     s->buf[s->pos++] = (unsigned char)c;
+    return (unsigned char)c;
+}
 
-    if (s->pos == s->cap) {
+static int do_fflush(MYSTREAM *s)
+{
+    if (s->mode == MY_WRITE) return flush_write_buffer(s);
+    return discard_read_buffer(s);
+}
+
+static off_t do_ftell(MYSTREAM *s)
+{
+    if (s->mode == MY_WRITE && (s->flags & MYF_APPEND)) {
+        //O_APPEND moves the kernel offset to EOF behind our back
         if (flush_write_buffer(s) < 0) return -1;
+        off_t cur = sys_lseek(s, 0, SEEK_CUR);
+        if (cur < 0) return -1;
+        s->off = cur;
     }
-    return (unsigned char)c;
+    return s->off + (off_t)s->pos;
 }
 
-int myfclose(MYSTREAM *s)
+static int do_fseek(MYSTREAM *s, off_t offset, int whence)
+{
+    if (s->mode == MY_WRITE) {
+        if (flush_write_buffer(s) < 0) return -1;
+        if (whence == SEEK_CUR) { offset += do_ftell(s); whence = SEEK_SET; }
+        off_t r = sys_lseek(s, offset, whence);
+        if (r < 0) return -1;
+        s->off = r;
+        s->eof = 0;
+        return 0;
+    }
+
+    off_t target;
+    if (whence == SEEK_SET) target = offset;
+    else if (whence == SEEK_CUR) target = s->off + (off_t)s->pos + offset;
+    else if (whence == SEEK_END && (s->flags & MYF_MAPPED)) target = (off_t)s->len + offset;
+    else if (whence == SEEK_END) {
+        //need the file size anyway, let the kernel work it out
+        if (discard_read_buffer(s) < 0) return -1;
+        off_t r = sys_lseek(s, offset, SEEK_END);
+        if (r < 0) return -1;
+        if (s->pf && reset_prefetch(s, r) < 0) return -1;
+        s->off = r;
+        s->eof = 0;
+        return 0;
+    }
+    else { errno = EINVAL; return -1; }
+    if (target < 0) { errno = EINVAL; return -1; }
+
+    if (s->flags & MYF_MAPPED) {
+        //the mapping is the whole file; past the end we just sit at EOF
+        if (target <= (off_t)s->len) { s->off = 0; s->pos = (size_t)target; }
+        else { s->off = target - (off_t)s->len; s->pos = s->len; }
+        s->eof = 0;
+        return 0;
+    }
+
+    //landing inside what's already buffered is just moving pos
+    if (target >= s->off && target <= s->off + (off_t)s->len) {
+        s->pos = (size_t)(target - s->off);
+        s->eof = 0;
+        return 0;
+    }
+
+    if (s->pf) {
+        if (reset_prefetch(s, target) < 0) return -1;
+    } else if (sys_lseek(s, target, SEEK_SET) < 0) {
+        return -1;
+    }
+    s->off = target;
+    s->pos = 0;
+    s->len = 0;
+    s->eof = 0;
+    return 0;
+}
+
+//locking entry points: a no-op NULL check for streams opened without "l"
+
+void myflockfile(MYSTREAM *s)   { LOCK(s); }
+void myfunlockfile(MYSTREAM *s) { UNLOCK(s); }
+
+int (myfgetc)(MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    int c = myfgetc_unlocked(s);
+    UNLOCK(s);
+    return c;
+}
+
+int (myfputc)(int c, MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    int r = myfputc_unlocked(c, s);
+    UNLOCK(s);
+    return r;
+}
+
+ssize_t myfread(void *ptr, size_t n, MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    ssize_t r = myfread_unlocked(ptr, n, s);
+    UNLOCK(s);
+    return r;
+}
+
+ssize_t myfwrite(const void *ptr, size_t n, MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    ssize_t r = myfwrite_unlocked(ptr, n, s);
+    UNLOCK(s);
+    return r;
+}
+
+ssize_t myfwritev(const struct iovec *iov, int iovcnt, MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    ssize_t r = myfwritev_unlocked(iov, iovcnt, s);
+    UNLOCK(s);
+    return r;
+}
+
+char *myfgets(char *dst, int size, MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return NULL; }
+    LOCK(s);
+    char *r = myfgets_unlocked(dst, size, s);
+    UNLOCK(s);
+    return r;
+}
+
+int myfflush(MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    int r = do_fflush(s);
+    UNLOCK(s);
+    return r;
+}
+
+off_t myftell(MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    off_t r = do_ftell(s);
+    UNLOCK(s);
+    return r;
+}
+
+int myfseek(MYSTREAM *s, off_t offset, int whence)
 {
     if (!s) { errno = EINVAL; return -1; }
+    LOCK(s);
+    int r = do_fseek(s, offset, whence);
+    UNLOCK(s);
+    return r;
+}
+
+int myfstats(MYSTREAM *s, struct mystats *out)
+{
+    if (!s || !out) { errno = EINVAL; return -1; }
+    LOCK(s);
+    if (s->pf) {
+        //the read-ahead thread updates the read counters under its lock
+        pthread_mutex_lock(&s->pf->lock);
+        *out = s->stats;
+        pthread_mutex_unlock(&s->pf->lock);
+    } else {
+        *out = s->stats;
+    }
+    UNLOCK(s);
+    return 0;
+}
 
+static void print_stats(MYSTREAM *s)
+{
+    const struct mystats *st = &s->stats;
+    fprintf(stderr,
+        "mylib: fd %d: %llu read() %llu bytes (avg %llu), %llu refills, %.3f ms in read;"
+        " %llu write() %llu bytes (avg %llu), %llu short, %.3f ms in write;"
+        " %llu lseek(); bufsiz %zu%s\n",
+        s->fd,
+        st->reads, st->bytes_read, st->reads ? st->bytes_read / st->reads : 0ULL,
+        st->refills, st->read_ns / 1e6,
+        st->writes, st->bytes_written, st->writes ? st->bytes_written / st->writes : 0ULL,
+        st->short_writes, st->write_ns / 1e6,
+        st->seeks, s->cap, (s->flags & MYF_MAPPED) ? " (mmap)" : "");
+}
+
+//flush and close the fd, leaving the buffer and lock alone
+static int close_stream(MYSTREAM *s)
+{
     int rc = 0;
+    LOCK(s);
     if (s->mode == MY_WRITE) {
         if (flush_write_buffer(s) < 0) rc = -1;
     }
+    UNLOCK(s);
+    if (s->pf) stop_prefetch(s); //helper must be off the fd before we close it
+    if (s->flags & MYF_TRACE) print_stats(s);
 
     if (close(s->fd) < 0) rc = -1;
+    return rc;
+}
 
-    free(s->buf);
-    free(s);
+int myfclose(MYSTREAM *s)
+{
+    if (!s) { errno = EINVAL; return -1; }
+
+    int rc = close_stream(s);
+    release_stream(s);
+    free_block(s);
     return rc;
 }
+
+//re-run init_stream on an already closed and released stream; on failure
+//the block goes back where it came from
+static MYSTREAM *reinit_stream(MYSTREAM *s, int fd, int m, int sflags)
+{
+    struct stat stbuf;
+    const struct stat *st = (fstat(fd, &stbuf) == 0) ? &stbuf : NULL;
+    if (init_stream(s, fd, m, sflags, s->pool ? s->pool->bufsiz : 0, st) < 0) {
+        int saved = errno;
+        free_block(s);
+        errno = saved;
+        return NULL;
+    }
+    return s;
+}
+
+//a bad mode still closes the stream, as the reopen contract promises
+static MYSTREAM *close_bad_mode(MYSTREAM *s)
+{
+    int saved = errno;
+    myfclose(s);
+    errno = saved;
+    return NULL;
+}
+
+//reuse s (and its buffer, if the new fd wants no bigger one) for another
+//fd. Like freopen, the old fd is closed regardless, and if setting up the
+//new one fails the stream is gone and NULL comes back.
+MYSTREAM *myfdreopen(int fd, const char *mode, MYSTREAM *s)
+{
+    int m, sflags, oflags;
+    if (!s) { errno = EINVAL; return NULL; }
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return close_bad_mode(s);
+
+    close_stream(s);
+    release_stream(s);
+    return reinit_stream(s, fd, m, sflags);
+}
+
+MYSTREAM *myfreopen(const char *pathname, const char *mode, MYSTREAM *s)
+{
+    int m, sflags, oflags;
+    if (!s) { errno = EINVAL; return NULL; }
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return close_bad_mode(s);
+
+    close_stream(s);
+    release_stream(s);
+
+    int fd = open(pathname, oflags, 0666);
+    if (fd < 0) {
+        int saved = errno;
+        free_block(s);
+        errno = saved;
+        return NULL;
+    }
+    if (!reinit_stream(s, fd, m, sflags)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    return s;
+}
+
+//pools: closed streams go back on the pool's free list with their buffer
+//and are handed out again by mypool_fopen/mypool_fdopen
+
+MYPOOL *mypool_create(int bufsiz)
+{
+    MYPOOL *p = (MYPOOL*)malloc(sizeof(*p));
+    if (!p) return NULL;
+    pthread_mutex_init(&p->lock, NULL);
+    p->free_list = NULL;
+    p->nfree  = 0;
+    p->bufsiz = (bufsiz > 0) ? bufsiz : (int)MY_FILE_BUF;
+    return p;
+}
+
+static MYSTREAM *pool_get(MYPOOL *p)
+{
+    pthread_mutex_lock(&p->lock);
+    MYSTREAM *s = p->free_list;
+    if (s) {
+        p->free_list = s->pool_next;
+        p->nfree--;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (!s) {
+        size_t icap = ((size_t)p->bufsiz < MY_HUGE_PAGE) ? (size_t)p->bufsiz : 0;
+        s = new_block(icap);
+        if (!s) return NULL;
+        s->pool = p;
+    }
+    return s;
+}
+
+MYSTREAM *mypool_fdopen(MYPOOL *p, int fd, const char *mode)
+{
+    int m, sflags, oflags;
+    if (!p) { errno = EINVAL; return NULL; }
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return NULL;
+
+    MYSTREAM *s = pool_get(p);
+    if (!s) return NULL;
+    return reinit_stream(s, fd, m, sflags);
+}
+
+MYSTREAM *mypool_fopen(MYPOOL *p, const char *pathname, const char *mode)
+{
+    int m, sflags, oflags;
+    if (!p) { errno = EINVAL; return NULL; }
+    if (parse_mode(mode, &m, &sflags, &oflags) < 0) return NULL;
+
+    int fd = open(pathname, oflags, 0666);
+    if (fd < 0) return NULL;
+
+    MYSTREAM *s = pool_get(p);
+    if (!s || !reinit_stream(s, fd, m, sflags)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    return s;
+}
+
+//every stream from the pool must be closed first
+void mypool_destroy(MYPOOL *p)
+{
+    if (!p) return;
+    while (p->free_list) {
+        MYSTREAM *s = p->free_list;
+        p->free_list = s->pool_next;
+        free(s);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
@@ -2,6 +2,8 @@
 #define MYLIB_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,18 +11,139 @@ extern "C" {
 
 
 typedef struct MYSTREAM MYSTREAM;
+typedef struct MYPOOL MYPOOL;
 
+//per-stream I/O counters, see myfstats(). The *_ns times are only
+//measured when MYLIB_STATS is set in the environment, which also makes
+//myfclose print a one-line summary of these to stderr.
+struct mystats {
+    unsigned long long reads;          //read() calls
+    unsigned long long bytes_read;
+    unsigned long long refills;        //times the buffer ran dry and was refilled
+    unsigned long long writes;         //write()/writev() calls
+    unsigned long long bytes_written;
+    unsigned long long short_writes;   //writes the kernel only partly took
+    unsigned long long seeks;          //lseek() calls
+    unsigned long long read_ns;        //time blocked in read()
+    unsigned long long write_ns;       //time blocked in write()/writev()
+};
 
+//only exposed so the myfgetc/myfputc macros below can inline the common
+//case (like getc_unlocked); everything else should treat it as opaque
+struct MYSTREAM {
+    unsigned char *buf;
+    size_t pos;     //next byte to read / next free slot to write
+    size_t len;     //valid bytes in buf when reading (always 0 when writing)
+    size_t wcap;    //write limit: cap when writing, 0 when reading
+    size_t cap;
+    off_t off;      //file offset of buf[0]
+    int fd;
+    int mode;
+    int flags;
+    int eof;
+    int full_runs;  //consecutive full reads/flushes, drives buffer growth
+    struct mystats stats;
+    struct my_prefetch *pf; //read-ahead thread state for "rp", else NULL
+    struct my_lock *lock;   //per-stream lock for "l" streams, else NULL
+    size_t icap;            //size of the buffer allocated along with the struct
+    MYPOOL *pool;           //pool the stream goes back to on close, or NULL
+    MYSTREAM *pool_next;
+};
+
+//modes: "r", "w", "a", each optionally with "+" for read and write
+//(like fopen), plus read-only modifiers
+//  "rm": read a regular file through mmap with no copying into a buffer.
+//        if the file is truncated while it's being read, touching the
+//        missing pages raises SIGBUS, so never write over your own input
+//  "rp": a helper thread reads the next buffers ahead while the current
+//        one is consumed (link with -pthread)
+//pipes, ttys etc. quietly fall back to plain "r" for either; "rmp" maps
+//when it can and prefetches otherwise.
+//Any mode may add "l" (e.g. "wl") to give the stream its own lock so
+//threads can share it; without it no locking is done at all.
 MYSTREAM *myfopen(const char *pathname, const char *mode);
 MYSTREAM *myfdopen(int filedesc, const char *mode);
 int myfgetc(MYSTREAM *stream);
 int myfputc(int c, MYSTREAM *stream);
 int myfclose(MYSTREAM *stream);
 
+//threads sharing an "l" stream can hold its lock across several calls
+//(e.g. to emit a whole record); it's recursive, and a no-op without "l"
+void myflockfile(MYSTREAM *stream);
+void myfunlockfile(MYSTREAM *stream);
+
+//*_unlocked variants never touch the lock: for streams without "l", or
+//while the caller holds myflockfile()
+int myfgetc_unlocked(MYSTREAM *stream);
+int myfputc_unlocked(int c, MYSTREAM *stream);
+
+//fast path: take/put one byte straight from/into buf and only call the
+//real function to refill, flush, or report EOF/errors. Like getc, the
+//stream argument may be evaluated more than once and must not be NULL;
+//use (myfgetc)(s) / (myfputc)(c, s) to get the checked function.
+//Locked streams always go through the function.
+#define myfgetc_unlocked(s) \
+    ((s)->pos < (s)->len ? (int)(s)->buf[(s)->pos++] : (myfgetc_unlocked)(s))
+#define myfputc_unlocked(c, s) \
+    ((s)->pos < (s)->wcap ? (int)((s)->buf[(s)->pos++] = (unsigned char)(c)) \
+                          : (myfputc_unlocked)((c), (s)))
+#define myfgetc(s) ((s)->lock ? (myfgetc)(s) : myfgetc_unlocked(s))
+#define myfputc(c, s) ((s)->lock ? (myfputc)((c), (s)) : myfputc_unlocked((c), (s)))
+
+//bulk I/O: copies whole spans through the buffer; requests of at least
+//bufsiz bytes go straight to read()/write() without touching the buffer
+ssize_t myfread(void *ptr, size_t n, MYSTREAM *stream);   //bytes read, 0 at EOF (errno 0), -1 on error
+ssize_t myfwrite(const void *ptr, size_t n, MYSTREAM *stream); //n on success, -1 on error
+char *myfgets(char *dst, int size, MYSTREAM *stream);     //like fgets, NULL at EOF (errno 0) or error
+
+//zero-copy reading: myfpeek returns the unread bytes already in the
+//buffer (refilling it first if it's empty; for "rm" that is the rest of
+//the file) and myfskip consumes n of them. NULL at EOF (errno 0) or on
+//error. Neither locks, so hold myflockfile() around them on "l" streams.
+const unsigned char *myfpeek(MYSTREAM *stream, size_t *avail);
+int myfskip(MYSTREAM *stream, size_t n);
+
+//gather write: the spans are copied into the buffer if they fit, otherwise
+//the buffer and all spans go out together in one writev(). Returns the
+//total length or -1.
+ssize_t myfwritev(const struct iovec *iov, int iovcnt, MYSTREAM *stream);
+
+ssize_t myfread_unlocked(void *ptr, size_t n, MYSTREAM *stream);
+ssize_t myfwrite_unlocked(const void *ptr, size_t n, MYSTREAM *stream);
+char *myfgets_unlocked(char *dst, int size, MYSTREAM *stream);
+ssize_t myfwritev_unlocked(const struct iovec *iov, int iovcnt, MYSTREAM *stream);
+
+//positioning; whence is SEEK_SET/SEEK_CUR/SEEK_END. A seek that stays
+//inside the current read buffer only moves pos and makes no syscall.
+//On a read stream myfflush drops read-ahead and rewinds the fd to match.
+int myfseek(MYSTREAM *stream, off_t offset, int whence);
+off_t myftell(MYSTREAM *stream);
+int myfflush(MYSTREAM *stream);
+
+int myfstats(MYSTREAM *stream, struct mystats *out);
+
 //Problem 5 (extra credit)
+//bufsiz <= 0 sizes the buffer from fstat (st_blksize for files, pipe
+//capacity for pipes, BUFSIZ for ttys) and lets it double up to 8MB while
+//the fd keeps filling it; myfopen/myfdopen always do that
 MYSTREAM *myfopen_ex(const char *pathname, const char *mode, int bufsiz);
 MYSTREAM *myfdopen_ex(int fd, const char *mode, int bufsiz);
 
+//reuse an open stream for another file/fd instead of close + open: the
+//old fd is flushed and closed, and the stream keeps its buffer when it is
+//big enough. On failure the stream has been closed and NULL is returned.
+MYSTREAM *myfreopen(const char *pathname, const char *mode, MYSTREAM *stream);
+MYSTREAM *myfdreopen(int fd, const char *mode, MYSTREAM *stream);
+
+//a pool recycles closed streams (struct and buffer are one allocation)
+//so opening and closing lots of small files costs no malloc/free. All
+//pool streams use the pool's bufsiz (<= 0 picks 128KB); myfclose hands
+//them back. Close every stream before destroying the pool.
+MYPOOL *mypool_create(int bufsiz);
+MYSTREAM *mypool_fopen(MYPOOL *pool, const char *pathname, const char *mode);
+MYSTREAM *mypool_fdopen(MYPOOL *pool, int fd, const char *mode);
+void mypool_destroy(MYPOOL *pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,226 @@
+//tab expansion shared by tabstop and mybench
+#define _POSIX_C_SOURCE 200809L
+#include "tabexpand.h"
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+int parse_tabspec(const char *s, struct tabspec *ts)
+{
+    int n = 1;
+    for (const char *c = s; *c; c++) if (*c == ',') n++;
+    int *stops = (int*)malloc((size_t)n * sizeof(int));
+    if (!stops) return -1;
+
+    for (int i = 0; i < n; i++) {
+        char *end = NULL;
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (end == s || errno || v <= 0 || v > 1<<26 || (i > 0 && v <= stops[i-1])
+            || (*end != ',' && *end != '\0')) {
+            free(stops);
+            return -1;
+        }
+        stops[i] = (int)v;
+        s = end + 1;
+    }
+
+    ts->column = 1;
+    if (n == 1) {
+        ts->width = stops[0];
+        free(stops);
+        ts->stops = NULL;
+        ts->nstops = 0;
+    } else {
+        ts->width = 0;
+        ts->stops = stops;
+        ts->nstops = n;
+    }
+    return 0;
+}
+
+//column the tab at col moves to; past the last listed stop it's one space
+static size_t next_stop(const struct tabspec *ts, size_t col)
+{
+    if (ts->width > 0) return col + (size_t)ts->width - col % (size_t)ts->width;
+    int lo = 0, hi = ts->nstops;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((size_t)ts->stops[mid] <= col) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < ts->nstops) ? (size_t)ts->stops[lo] : col + 1;
+}
+
+//block tab expansion: find each '\t' (and '\n' when tracking columns) in
+//the input buffer with SIMD, myfwrite the run before it in one go, then
+//the spaces for the whole run of tabs in one go
+
+static const unsigned char *find_tab_scalar(const unsigned char *p, const unsigned char *end, int c2)
+{
+    if (c2 == '\t') {
+        const unsigned char *t = (const unsigned char*)memchr(p, '\t', (size_t)(end - p));
+        return t ? t : end;
+    }
+    while (p < end && *p != '\t' && *p != c2) p++;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static const unsigned char *find_tab_sse2(const unsigned char *p, const unsigned char *end, int c2)
+{
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i other = _mm_set1_epi8((char)c2);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, other));
+        unsigned m = (unsigned)_mm_movemask_epi8(hit);
+        if (m) return p + __builtin_ctz(m);
+    }
+    return find_tab_scalar(p, end, c2);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *find_tab_avx2(const unsigned char *p, const unsigned char *end, int c2)
+{
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i other = _mm256_set1_epi8((char)c2);
+    for (; end - p >= 64; p += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+        __m256i ha = _mm256_or_si256(_mm256_cmpeq_epi8(a, tab), _mm256_cmpeq_epi8(a, other));
+        __m256i hb = _mm256_or_si256(_mm256_cmpeq_epi8(b, tab), _mm256_cmpeq_epi8(b, other));
+        unsigned ma = (unsigned)_mm256_movemask_epi8(ha);
+        unsigned mb = (unsigned)_mm256_movemask_epi8(hb);
+        if (ma) return p + __builtin_ctz(ma);
+        if (mb) return p + 32 + __builtin_ctz(mb);
+    }
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, other));
+        unsigned m = (unsigned)_mm256_movemask_epi8(hit);
+        if (m) return p + __builtin_ctz(m);
+    }
+    return find_tab_scalar(p, end, c2);
+}
+#endif
+
+//returns the first '\t' or c2 in [p, end), or end
+typedef const unsigned char *(*find_tab_fn)(const unsigned char *, const unsigned char *, int);
+
+//picked once at startup from what the CPU we're running on supports
+static find_tab_fn pick_find_tab(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_tab_avx2;
+    if (__builtin_cpu_supports("sse2")) return find_tab_sse2;
+#endif
+    return find_tab_scalar;
+}
+
+static find_tab_fn find_tab = find_tab_scalar;
+
+void tabexpand_init(void)
+{
+    find_tab = pick_find_tab();
+}
+
+//expanded output is staged here and handed to myfwrite a block at a
+//time, so short runs between tabs cost a memcpy rather than a call
+#define STAGE_SIZE (64 * 1024)
+
+int expand_tabs(MYSTREAM *in, MYSTREAM *out, const struct tabspec *ts)
+{
+    unsigned char stage[STAGE_SIZE]; //per call, so worker threads don't share it
+    size_t used = 0;
+    size_t col = 0; //carried across myfpeek blocks
+    const int stop = ts->column ? '\n' : '\t';
+
+    for (;;) {
+        size_t n;
+        const unsigned char *p = myfpeek(in, &n);
+        if (!p) {
+            if (errno != 0) return EXPAND_READ_ERR;
+            if (used > 0 && myfwrite(stage, used, out) < 0) return EXPAND_WRITE_ERR;
+            return EXPAND_OK;
+        }
+
+        const unsigned char *end = p + n;
+        const unsigned char *q = p;
+        while (q < end) {
+            const unsigned char *t = find_tab(q, end, stop);
+            int nl = (t < end && *t == '\n');
+            size_t run = (size_t)(t - q) + (size_t)nl;
+
+            if (run > STAGE_SIZE - used) {
+                if (myfwrite(stage, used, out) < 0) return EXPAND_WRITE_ERR;
+                used = 0;
+            }
+            if (used == 0 && run >= STAGE_SIZE / 2) {
+                //long tab-free stretch: straight from the input buffer
+                if (myfwrite(q, run, out) < 0) return EXPAND_WRITE_ERR;
+            } else {
+                memcpy(stage + used, q, run);
+                used += run;
+            }
+            if (nl) { col = 0; q = t + 1; continue; }
+            col += run;
+            if (t == end) break;
+
+            //a whole run of tabs becomes one block of spaces
+            const unsigned char *r = t;
+            size_t nsp;
+            if (!ts->column) {
+                while (r < end && *r == '\t') r++;
+                nsp = (size_t)(r - t) * TAB_WIDTH;
+            } else {
+                size_t c = col;
+                while (r < end && *r == '\t') { c = next_stop(ts, c); r++; }
+                nsp = c - col;
+                col = c;
+            }
+            while (nsp > 0) {
+                if (used == STAGE_SIZE) {
+                    if (myfwrite(stage, used, out) < 0) return EXPAND_WRITE_ERR;
+                    used = 0;
+                }
+                size_t k = (nsp < STAGE_SIZE - used) ? nsp : STAGE_SIZE - used;
+                memset(stage + used, ' ', k);
+                used += k;
+                nsp -= k;
+            }
+            q = r;
+        }
+        myfskip(in, n);
+    }
+}
+
+size_t count_tabs(const unsigned char *p, const unsigned char *end)
+{
+    size_t n = 0;
+    while ((p = find_tab(p, end, '\t')) < end) { n++; p++; }
+    return n;
+}
+
+size_t expand_mem(const unsigned char *p, const unsigned char *end, unsigned char *dst)
+{
+    unsigned char *d = dst;
+    while (p < end) {
+        const unsigned char *t = find_tab(p, end, '\t');
+        memcpy(d, p, (size_t)(t - p));
+        d += t - p;
+        if (t == end) break;
+        const unsigned char *r = t;
+        while (r < end && *r == '\t') r++;
+        memset(d, ' ', (size_t)(r - t) * TAB_WIDTH);
+        d += (r - t) * TAB_WIDTH;
+        p = r;
+    }
+    return (size_t)(d - dst);
+}
@@ -0,0 +1,41 @@
+#ifndef TABEXPAND_H
+#define TABEXPAND_H
+
+#include <stddef.h>
+#include "mylib.h"
+
+//tab expansion shared by tabstop and mybench, so the benchmark measures
+//the code tabstop really runs
+
+#define TAB_WIDTH 4
+
+//tab stops. without -t every tab is just TAB_WIDTH spaces; with -t the
+//column is tracked and a tab moves to the next stop, like expand -t.
+//columns count bytes, '\n' resets to column 0
+struct tabspec {
+    int column;     //0: fixed TAB_WIDTH spaces per tab
+    int width;      //stop every width columns, or 0 when a list is given
+    int *stops;     //explicit stops, strictly increasing
+    int nstops;
+};
+
+//N (every N columns) or N1,N2,... (strictly increasing); -1 if malformed
+int parse_tabspec(const char *s, struct tabspec *ts);
+
+//pick the SSE2/AVX2/scalar tab scanner for this CPU; call once before
+//any threads start (until then the scalar one is used)
+void tabexpand_init(void);
+
+enum { EXPAND_OK = 0, EXPAND_READ_ERR, EXPAND_WRITE_ERR };
+
+//copy in to out with tabs expanded per ts; EXPAND_OK or which side failed
+//(errno says why)
+int expand_tabs(MYSTREAM *in, MYSTREAM *out, const struct tabspec *ts);
+
+//fixed TAB_WIDTH expansion of a memory block, for -P: count_tabs says how
+//much bigger it gets, expand_mem writes it to dst, which holds at least
+//(end - p) * TAB_WIDTH bytes, and returns the length
+size_t count_tabs(const unsigned char *p, const unsigned char *end);
+size_t expand_mem(const unsigned char *p, const unsigned char *end, unsigned char *dst);
+
+#endif
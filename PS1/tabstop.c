@@ -1,19 +1,32 @@
+//build: gcc -O2 -pthread -o tabstop tabstop.c tabexpand.c mylib.c
 #define _POSIX_C_SOURCE 200809L //featured in man pages for MacOS using this standard for system calls
 #include "mylib.h"
+#include "tabexpand.h"
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int prefetch = 0; //-p: input files get a read-ahead thread
 
 static void usage(const char *prog) { //error message
     fprintf(stderr,
       "Usage:\n"
-      "  %s [-b bufsiz] -o OUTFILE INFILE\n"
-      "  %s [-b bufsiz] -o OUTFILE\n"
-      "  %s [-b bufsiz] INFILE\n"
-      "  %s [-b bufsiz]\n", prog, prog, prog, prog);
+      "  %s [-b bufsiz] [-p] [-t stops] -o OUTFILE INFILE\n"
+      "  %s [-b bufsiz] [-t stops] -o OUTFILE\n"
+      "  %s [-b bufsiz] [-p] [-t stops] INFILE\n"
+      "  %s [-b bufsiz] [-t stops]\n"
+      "  %s [-b bufsiz] [-p] [-t stops] [-j jobs] -d OUTDIR INFILE...\n"
+      "  %s -P threads [-o OUTFILE] INFILE\n"
+      "stops is N (every N columns) or N1,N2,... (explicit columns)\n"
+      "-p reads input files ahead on a helper thread (helps cold-cache files)\n",
+      prog, prog, prog, prog, prog, prog);
 }
 
 static int parse_pos_int(const char *s) {
@@ -24,87 +37,451 @@ static int parse_pos_int(const char *s) {
     return (int)v;
 }
 
-int main(int argc, char **argv)
+static int same_file(const struct stat *a, const struct stat *b)
 {
-    const char *infile  = NULL;
-    const char *outfile = NULL;
-    int bufsiz = 0; 
-    
-    
-    for (int i = 1; i < argc; ++i) { //error handling returning 255 if something went wrong
-        if (strcmp(argv[i], "-b") == 0) {
-            if (i+1 >= argc) { usage(argv[0]); return 255; }
-            bufsiz = parse_pos_int(argv[++i]);
-            if (bufsiz <= 0) { fprintf(stderr, "Invalid -b value\n"); return 255; }
-        } else if (strcmp(argv[i], "-o") == 0) {
-            if (i+1 >= argc) { usage(argv[0]); return 255; }
-            outfile = argv[++i];
-        } else if (argv[i][0] == '-') {
-            usage(argv[0]); return 255;
-        } else {
-            if (infile) { usage(argv[0]); return 255; }
-            infile = argv[i];
-        }
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+//open outfile for writing, refusing when it is the input (ist): "rm" has
+//the input mapped, and truncating it underneath would SIGBUS us and leave
+//the input empty. So it's opened without O_TRUNC, compared, and only then
+//truncated. -1 with the error printed on failure
+static int open_output(const char *outfile, const struct stat *ist)
+{
+    int fd = open(outfile, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) { fprintf(stderr, "open output '%s': %s\n", outfile, strerror(errno)); return -1; }
+    struct stat ost;
+    if (fstat(fd, &ost) < 0) {
+        fprintf(stderr, "stat output '%s': %s\n", outfile, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (ist && same_file(ist, &ost)) {
+        fprintf(stderr, "'%s': output file is the input file\n", outfile);
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(ost.st_mode) && ftruncate(fd, 0) < 0) {
+        fprintf(stderr, "truncate output '%s': %s\n", outfile, strerror(errno));
+        close(fd);
+        return -1;
     }
-    
-    
+    return fd;
+}
+
+//expand infile into outfile (NULL means stdin/stdout), reporting any
+//error itself. outputs come from pool when one is given
+static int convert(const char *infile, const char *outfile, int bufsiz,
+                   const struct tabspec *ts, MYPOOL *pool)
+{
     MYSTREAM *in = NULL, *out = NULL;
-    
+
+    struct stat ist;
+    int have_ist = infile ? stat(infile, &ist) == 0 : fstat(STDIN_FILENO, &ist) == 0;
+    if (!outfile && have_ist) { //tabstop f >> f
+        struct stat ost;
+        if (fstat(STDOUT_FILENO, &ost) == 0 && S_ISREG(ost.st_mode) && same_file(&ist, &ost)) {
+            fprintf(stderr, "%s: output file is the input file\n", infile ? infile : "<stdin>");
+            return -1;
+        }
+    }
+
     if (infile) {
-        in = (bufsiz > 0) ? myfopen_ex(infile, "r", bufsiz)
-        : myfopen(infile, "r");
-        if (!in) { fprintf(stderr, "open input '%s': %s\n", infile, strerror(errno)); return 255; }
+        if (prefetch) in = myfopen_ex(infile, "rp", bufsiz);
+        else in = (bufsiz > 0) ? myfopen_ex(infile, "r", bufsiz)
+        : myfopen(infile, "rm"); //no -b given: map the input if it's a regular file
+        if (!in) { fprintf(stderr, "open input '%s': %s\n", infile, strerror(errno)); return -1; }
     } else {
         in = (bufsiz > 0) ? myfdopen_ex(STDIN_FILENO, "r", bufsiz)
         : myfdopen(STDIN_FILENO, "r");
-        if (!in) { perror("fdopen stdin"); return 255; }
+        if (!in) { perror("fdopen stdin"); return -1; }
     }
-    
-    
+
     if (outfile) {
-        out = (bufsiz > 0) ? myfopen_ex(outfile, "w", bufsiz)
-        : myfopen(outfile, "w");
+        int ofd = open_output(outfile, have_ist ? &ist : NULL);
+        if (ofd < 0) { myfclose(in); return -1; }
+        if (pool) out = mypool_fdopen(pool, ofd, "w");
+        else out = (bufsiz > 0) ? myfdopen_ex(ofd, "w", bufsiz) : myfdopen(ofd, "w");
         if (!out) {
             fprintf(stderr, "open output '%s': %s\n", outfile, strerror(errno));
+            close(ofd);
             myfclose(in);
-            return 255;
+            return -1;
         }
     } else {
         out = (bufsiz > 0) ? myfdopen_ex(STDOUT_FILENO, "w", bufsiz)
         : myfdopen(STDOUT_FILENO, "w");
-        if (!out) { perror("fdopen stdout"); myfclose(in); return 255; }
+        if (!out) { perror("fdopen stdout"); myfclose(in); return -1; }
+    }
+
+    int rc = expand_tabs(in, out, ts);
+    if (rc != EXPAND_OK) {
+        fprintf(stderr, "%s: %s error: %s\n", infile ? infile : "<stdin>",
+                rc == EXPAND_READ_ERR ? "read" : "write", strerror(errno));
+        myfclose(in); myfclose(out);
+        return -1;
     }
-    
-    
+
+    if (myfclose(in)  < 0) { perror("close input"); }
+    if (myfclose(out) < 0) { perror("close output"); return -1; }
+    return 0;
+}
+
+//-d mode: workers pull the next input off a shared index until none are
+//left, each writing OUTDIR/<basename of input>
+struct batch {
+    char **files;
+    int nfiles;
+    const char *outdir;
+    int bufsiz;
+    const struct tabspec *ts;
+    MYPOOL *pool;   //output streams, recycled across files
+    int next;       //next file to hand out
+    int failed;
+};
+
+static const char *base_name(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+static int cmp_base(const void *a, const void *b)
+{
+    return strcmp(base_name(*(char * const *)a), base_name(*(char * const *)b));
+}
+
+//two inputs with the same basename would have workers racing on one
+//output file, so refuse the whole batch before anything is written
+static int check_batch(char **files, int nfiles)
+{
+    char **sorted = (char**)malloc((size_t)nfiles * sizeof(char*));
+    if (!sorted) { perror("malloc"); return -1; }
+    memcpy(sorted, files, (size_t)nfiles * sizeof(char*));
+    qsort(sorted, (size_t)nfiles, sizeof(char*), cmp_base);
+    int rc = 0;
+    for (int i = 1; i < nfiles; i++) {
+        if (cmp_base(&sorted[i - 1], &sorted[i]) == 0) {
+            fprintf(stderr, "'%s' and '%s' would both be written to the same output file\n",
+                    sorted[i - 1], sorted[i]);
+            rc = -1;
+            break;
+        }
+    }
+    free(sorted);
+    return rc;
+}
+
+static int convert_into_dir(struct batch *b, const char *infile)
+{
+    const char *base = base_name(infile);
+    if (!*base) { fprintf(stderr, "'%s': no file name\n", infile); return -1; }
+
+    size_t len = strlen(b->outdir) + strlen(base) + 2;
+    char *outfile = (char*)malloc(len);
+    if (!outfile) { perror("malloc"); return -1; }
+    snprintf(outfile, len, "%s/%s", b->outdir, base);
+    int rc = convert(infile, outfile, b->bufsiz, b->ts, b->pool);
+    free(outfile);
+    return rc;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch *b = (struct batch*)arg;
     for (;;) {
-        int ch = myfgetc(in);
-        if (ch == -1) {
-            if (errno == 0) break; //EOF
-            fprintf(stderr, "read error: %s\n", strerror(errno));
-            myfclose(in); myfclose(out);
-            return 255;
+        int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->nfiles) return NULL;
+        if (convert_into_dir(b, b->files[i]) < 0)
+            __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int run_batch(struct batch *b, int jobs)
+{
+    if (jobs > b->nfiles) jobs = b->nfiles;
+    pthread_t *tids = (pthread_t*)malloc((size_t)jobs * sizeof(pthread_t));
+    if (!tids) { perror("malloc"); return -1; }
+
+    int started = 0;
+    for (; started < jobs - 1; started++) {
+        if (pthread_create(&tids[started], NULL, batch_worker, b) != 0) break;
+    }
+    batch_worker(b); //main thread is a worker too
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    return b->failed ? -1 : 0;
+}
+
+//-P mode: map one input, split it into chunks and expand them on threads.
+//fixed-width expansion carries nothing across chunks, so a chunk's output
+//offset is its input offset plus (TAB_WIDTH-1) for every tab before it.
+//a counting pass gives those offsets, then each thread pwrites its own
+//chunk. output that can't be pwritten (pipe, tty, O_APPEND) is done in
+//rounds of PAR_CHUNK per thread, written out in order by the main thread
+#define PAR_SLICE (256 * 1024)          //input per pwrite in a chunk
+#define PAR_CHUNK (8 * 1024 * 1024)     //input per chunk when writing in order
+#define PAR_MIN_CHUNK (1024 * 1024)
+#define PAR_MAX_THREADS 256             //-P above this is clamped
+
+struct chunk {
+    const unsigned char *p;
+    size_t len;
+    size_t tabs;
+    int fd;             //pwrite here at out_off, or -1 to keep it in out
+    off_t out_off;
+    unsigned char *out;
+    size_t out_len;
+    int err;            //errno of the first failure
+};
+
+static int write_all_fd(int fd, const unsigned char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        if (w == 0) { errno = EIO; return -1; } //no progress, don't spin
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const unsigned char *p, size_t n, off_t off)
+{
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        if (w == 0) { errno = EIO; return -1; }
+        p += w; n -= (size_t)w; off += w;
+    }
+    return 0;
+}
+
+static void *chunk_count_main(void *arg)
+{
+    struct chunk *c = (struct chunk*)arg;
+    c->tabs = count_tabs(c->p, c->p + c->len);
+    return NULL;
+}
+
+static void *chunk_expand_main(void *arg)
+{
+    struct chunk *c = (struct chunk*)arg;
+    const unsigned char *end = c->p + c->len;
+
+    if (c->fd < 0) { //buffer the whole chunk for the in-order writer
+        size_t tabs = count_tabs(c->p, end);
+        c->out = (unsigned char*)malloc(c->len + tabs * (TAB_WIDTH - 1) + 1);
+        if (!c->out) { c->err = errno; return NULL; }
+        c->out_len = expand_mem(c->p, end, c->out);
+        return NULL;
+    }
+
+    unsigned char *buf = (unsigned char*)malloc((size_t)PAR_SLICE * TAB_WIDTH);
+    if (!buf) { c->err = errno; return NULL; }
+    off_t off = c->out_off;
+    for (const unsigned char *p = c->p; p < end; p += PAR_SLICE) {
+        const unsigned char *e = (end - p > PAR_SLICE) ? p + PAR_SLICE : end;
+        size_t n = expand_mem(p, e, buf);
+        if (pwrite_all(c->fd, buf, n, off) < 0) { c->err = errno; break; }
+        off += (off_t)n;
+    }
+    free(buf);
+    return NULL;
+}
+
+//run fn on every chunk, one thread each (the last on this thread).
+//chunks whose thread couldn't be started run here afterwards
+static void run_chunks(void *(*fn)(void*), struct chunk *c, int n)
+{
+    pthread_t *tids = (pthread_t*)malloc((size_t)n * sizeof(pthread_t));
+    int *started = (int*)calloc((size_t)n, sizeof(int));
+    for (int i = 0; tids && started && i < n - 1; i++)
+        started[i] = (pthread_create(&tids[i], NULL, fn, &c[i]) == 0);
+    fn(&c[n-1]);
+    for (int i = 0; i < n - 1; i++) {
+        if (started && started[i]) pthread_join(tids[i], NULL);
+        else fn(&c[i]);
+    }
+    free(tids);
+    free(started);
+}
+
+static int chunk_errors(const struct chunk *c, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (c[i].err) { errno = c[i].err; return -1; }
+    return 0;
+}
+
+static int convert_parallel(const char *infile, const char *outfile, int threads)
+{
+    if (threads > PAR_MAX_THREADS) threads = PAR_MAX_THREADS;
+    int ifd = open(infile, O_RDONLY);
+    if (ifd < 0) { fprintf(stderr, "open input '%s': %s\n", infile, strerror(errno)); return -1; }
+    struct stat st;
+    if (fstat(ifd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "'%s': -P needs a regular input file\n", infile);
+        close(ifd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+
+    //the size is fixed here, so the output can't be the input either
+    int ofd = STDOUT_FILENO;
+    if (outfile) {
+        ofd = open_output(outfile, &st);
+        if (ofd < 0) { close(ifd); return -1; }
+    } else {
+        struct stat ost;
+        if (fstat(ofd, &ost) == 0 && same_file(&st, &ost)) {
+            fprintf(stderr, "%s: output file is the input file\n", infile);
+            close(ifd);
+            return -1;
         }
-        
-        if (ch == '\t') {
-            if (myfputc(' ', out) == -1 ||
-                myfputc(' ', out) == -1 ||
-                myfputc(' ', out) == -1 ||
-                myfputc(' ', out) == -1) {
-                fprintf(stderr, "write error: %s\n", strerror(errno));
-                myfclose(in); myfclose(out);
-                return 255;
+    }
+
+    const unsigned char *map = NULL;
+    if (size > 0) {
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, ifd, 0);
+        if (m == MAP_FAILED) { perror("mmap"); close(ifd); if (outfile) close(ofd); return -1; }
+        posix_madvise(m, size, POSIX_MADV_SEQUENTIAL);
+        map = (const unsigned char*)m;
+    }
+    close(ifd);
+
+    //pwrite only where a plain write would land at the file offset
+    struct stat ost;
+    off_t base = -1;
+    int fl = fcntl(ofd, F_GETFL);
+    if (fstat(ofd, &ost) == 0 && S_ISREG(ost.st_mode) && fl >= 0 && !(fl & O_APPEND))
+        base = lseek(ofd, 0, SEEK_CUR);
+
+    int rc = 0;
+    if (size == 0) {
+        //nothing to do
+    } else if (base >= 0) {
+        size_t per = (size + (size_t)threads - 1) / (size_t)threads;
+        if (per < PAR_MIN_CHUNK) per = PAR_MIN_CHUNK;
+        int n = (int)((size + per - 1) / per);
+        struct chunk *c = (struct chunk*)malloc((size_t)n * sizeof *c);
+        if (!c) { perror("malloc"); munmap((void*)map, size); if (outfile) close(ofd); return -1; }
+        for (int i = 0; i < n; i++) {
+            size_t start = (size_t)i * per;
+            c[i] = (struct chunk){ map + start, (size - start < per) ? size - start : per,
+                                   0, ofd, 0, NULL, 0, 0 };
+        }
+        run_chunks(chunk_count_main, c, n);
+        off_t off = base;
+        for (int i = 0; i < n; i++) {
+            c[i].out_off = off;
+            off += (off_t)(c[i].len + c[i].tabs * (TAB_WIDTH - 1));
+        }
+        run_chunks(chunk_expand_main, c, n);
+        rc = chunk_errors(c, n);
+        if (rc == 0 && lseek(ofd, off, SEEK_SET) < 0) rc = -1; //leave the offset where write() would
+        free(c);
+    } else {
+        struct chunk *c = (struct chunk*)malloc((size_t)threads * sizeof *c);
+        if (!c) { perror("malloc"); munmap((void*)map, size); if (outfile) close(ofd); return -1; }
+        for (size_t done = 0; done < size && rc == 0; ) {
+            int n = 0;
+            for (; n < threads && done < size; n++) {
+                size_t len = (size - done < PAR_CHUNK) ? size - done : PAR_CHUNK;
+                c[n] = (struct chunk){ map + done, len, 0, -1, 0, NULL, 0, 0 };
+                done += len;
             }
-        } else {
-            if (myfputc(ch, out) == -1) {
-                fprintf(stderr, "write error: %s\n", strerror(errno));
-                myfclose(in); myfclose(out);
-                return 255;
+            run_chunks(chunk_expand_main, c, n);
+            rc = chunk_errors(c, n);
+            for (int i = 0; i < n; i++) {
+                if (rc == 0 && write_all_fd(ofd, c[i].out, c[i].out_len) < 0) rc = -1;
+                free(c[i].out);
             }
         }
+        free(c);
     }
-    
-    if (myfclose(in)  < 0) { perror("close input"); }
-    if (myfclose(out) < 0) { perror("close output"); return 255; }
-    
-    return 0; //success
+
+    if (rc < 0) fprintf(stderr, "%s: write error: %s\n", infile, strerror(errno));
+    if (map) munmap((void*)map, size);
+    if (outfile && close(ofd) < 0 && rc == 0) { perror("close output"); rc = -1; }
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outfile = NULL;
+    const char *outdir  = NULL;
+    int bufsiz = 0;
+    int jobs = 0;
+    int par = 0;
+    struct tabspec ts = { 0, 0, NULL, 0 };
+    char **infiles = (char**)malloc((size_t)argc * sizeof(char*));
+    int ninfiles = 0;
+    if (!infiles) { perror("malloc"); return 255; }
+
+    for (int i = 1; i < argc; ++i) { //error handling returning 255 if something went wrong
+        if (strcmp(argv[i], "-b") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            bufsiz = parse_pos_int(argv[++i]);
+            if (bufsiz <= 0) { fprintf(stderr, "Invalid -b value\n"); return 255; }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            prefetch = 1;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            outfile = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            free(ts.stops);
+            if (parse_tabspec(argv[++i], &ts) < 0) { fprintf(stderr, "Invalid -t value\n"); return 255; }
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            jobs = parse_pos_int(argv[++i]);
+            if (jobs <= 0) { fprintf(stderr, "Invalid -j value\n"); return 255; }
+        } else if (strcmp(argv[i], "-P") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            par = parse_pos_int(argv[++i]);
+            if (par <= 0) { fprintf(stderr, "Invalid -P value\n"); return 255; }
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if (i+1 >= argc) { usage(argv[0]); return 255; }
+            outdir = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]); return 255;
+        } else {
+            infiles[ninfiles++] = argv[i];
+        }
+    }
+
+    //-d takes one or more inputs; otherwise it's the old one-file form
+    if (outdir ? (outfile || ninfiles == 0) : (jobs > 0 || ninfiles > 1)) {
+        usage(argv[0]); return 255;
+    }
+    if (par > 0 && (outdir || ninfiles != 1)) { usage(argv[0]); return 255; }
+    if (par > 0 && ts.column) { //columns depend on everything before the chunk
+        fprintf(stderr, "-P only does fixed-width expansion, not -t\n");
+        return 255;
+    }
+
+    tabexpand_init();
+
+    int rc;
+    if (par > 0) {
+        rc = convert_parallel(infiles[0], outfile, par);
+    } else if (!outdir) {
+        rc = convert(ninfiles ? infiles[0] : NULL, outfile, bufsiz, &ts, NULL);
+    } else {
+        if (jobs == 0) {
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = (ncpu > 0) ? (int)ncpu : 1;
+        }
+        if (check_batch(infiles, ninfiles) < 0) { free(ts.stops); free(infiles); return 255; }
+        struct batch b = { infiles, ninfiles, outdir, bufsiz, &ts, NULL, 0, 0 };
+        b.pool = mypool_create(bufsiz);
+        if (!b.pool) { perror("mypool_create"); return 255; }
+        rc = run_batch(&b, jobs);
+        mypool_destroy(b.pool);
+    }
+
+    free(ts.stops);
+    free(infiles);
+    return rc < 0 ? 255 : 0; //success
 }
@@ -0,0 +1,73 @@
+// Checks simplefind's -prune handling when the test guarding it needs a stat.
+// Build simplefind first, then:
+//   gcc -o pred_test pred_test.c && ./pred_test [path/to/simplefind]
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static const char *sf = "./simplefind";
+static char root[] = "/tmp/pred_test.XXXXXX";
+static int failures = 0;
+
+static void make(const char *rel, int dir) {
+    char path[512];
+    snprintf(path, sizeof path, "%s/%s", root, rel);
+    if (dir) {
+        if (mkdir(path, 0755) != 0) { perror(path); exit(1); }
+    } else {
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) { perror(path); exit(1); }
+        close(fd);
+    }
+}
+
+// run simplefind on the tree and compare the set of printed paths
+// (relative to root, sorted) against want, one per line
+static void expect(const char *name, const char *expr, const char *want) {
+    char cmd[1024], got[4096] = "", line[512];
+    snprintf(cmd, sizeof cmd, "%s %s %s | sed 's|^%s|.|' | sort", sf, root, expr, root);
+    FILE *p = popen(cmd, "r");
+    if (!p) { perror("popen"); exit(1); }
+    while (fgets(line, sizeof line, p)) strncat(got, line, sizeof got - strlen(got) - 1);
+    pclose(p);
+
+    if (strcmp(got, want) == 0) {
+        printf("ok   %s\n", name);
+    } else {
+        printf("FAIL %s\n  expr: %s\n  want:\n%s  got:\n%s", name, expr, want, got);
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) sf = argv[1];
+    if (!mkdtemp(root)) { perror("mkdtemp"); return 1; }
+    make("sub", 1);
+    make("sub/deeper", 1);
+    make("sub/file", 0);
+    make("other", 1);
+    make("other/x", 0);
+
+    // the -size is unknown until the stat, and the -prune after it in the
+    // same operand has to get its chance before -o -true settles things
+    expect("prune inside an unknown operand",
+           "\\( -name sub -size -1000 -prune \\) -o -true",
+           ".\n./other\n./other/x\n./sub\n");
+    expect("prune nested under an unknown -o",
+           "\\( -name sub -a \\( -size +1000 -o -prune \\) \\) -name nomatch -o -true",
+           ".\n./other\n./other/x\n./sub\n");
+    expect("prune not reached when the test fails",
+           "\\( -name sub -size +1000 -prune \\) -o -true",
+           ".\n./other\n./other/x\n./sub\n./sub/deeper\n./sub/file\n");
+
+    char cmd[600];
+    snprintf(cmd, sizeof cmd, "rm -rf %s", root);
+    if (system(cmd) != 0) fprintf(stderr, "warning: could not remove %s\n", root);
+
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
@@ -1,4 +1,6 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE // d_type / DT_* in struct dirent
+#define _GNU_SOURCE     // struct statx
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -6,37 +8,55 @@
 #include <errno.h>
 #include <ctype.h>
 #include <fnmatch.h>
+#include <regex.h>
 #include <limits.h>
 #include <dirent.h>
 #include <locale.h>
 #include <time.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 // recieved help from the internet
-/* 
+/*
  *  -l : print verbose info for each node (like "find -ls")
  *  -x : do not cross onto other filesystems (stay on same st_dev)
- *  -n : filter names against a shell pattern (fnmatch)
+ *  -n : filter names against a shell pattern (fnmatch), may be repeated
+ *  -N : read more -n patterns from a file, one per line
+ *  -j : number of walker threads, 1 to 1024 (default: one per CPU)
+ *  -u : print in whatever order the threads finish (default keeps walk order)
+ *  -a : stat entries in batches through io_uring (or a stat thread pool)
+ *  -0 : end each record with a NUL instead of a newline (like -print0)
+ *  -I : keep a directory index in this file and only reread what changed
+ *  -D : print disk usage per directory instead of the entries (like du)
+ *  -T : with -D, only the N largest directories, biggest first
+ *  an expression after the starting path filters and prunes, see pred_eval
   */
 
 // Command-line flags
 static int flag_long = 0;            // -l
 static int flag_xdev = 0;            // -x
-static const char *name_pat = NULL;  // -n pattern
+static const char **name_pats = NULL; // -n / -N patterns
+static int nname_pats = 0;
+static int flag_unordered = 0;       // -u
+static int flag_async = 0;           // -a
+static char record_end = '\n';       // -0 makes it '\0'
+static int flag_du = 0;              // -D
+static long du_top = 0;              // -T N
 
 static dev_t start_dev = (dev_t)-1;  // starting device (for -x)
 
-// Join two path components safely into dst.
-static int join_path(char dst[PATH_MAX], const char *a, const char *b) {
-    int n = snprintf(dst, PATH_MAX, "%s/%s", a, b);
-    return (n < 0 || (size_t)n >= PATH_MAX) ? -1 : 0;
-}
-
 // Check for empty string or illegal "/" in a name.
 static int invalid_component(const char *name) {
     if (!name || !*name) return 1;
@@ -61,115 +81,2206 @@ static void mode_to_string(mode_t m, char out[11]) {
     out[10] = '\0';
 }
 
+static time_t now_time;              // taken once at startup
+
 // Format modification time like ls does (recent files show HH:MM, old ones show year)
-static void time_to_ls(const struct timespec *ts, char *buf, size_t bufsz) {
-    time_t now = time(NULL);
-    time_t t = ts->tv_sec;
-    struct tm tmv, nowtm;
+static size_t time_to_ls(time_t t, char *buf, size_t bufsz) {
+    struct tm tmv;
     localtime_r(&t, &tmv);
-    localtime_r(&now, &nowtm);
 
     const double SIX_MONTHS = 15552000.0; // ~180 days
-    if (difftime(now, t) >= -SIX_MONTHS && difftime(now, t) <= SIX_MONTHS) {
-        strftime(buf, bufsz, "%b %e %H:%M", &tmv);
+    if (difftime(now_time, t) >= -SIX_MONTHS && difftime(now_time, t) <= SIX_MONTHS) {
+        return strftime(buf, bufsz, "%b %e %H:%M", &tmv);
     } else {
-        strftime(buf, bufsz, "%b %e  %Y", &tmv);
+        return strftime(buf, bufsz, "%b %e  %Y", &tmv);
+    }
+}
+
+// localtime_r + strftime per file is a big part of -l, and files in a
+// tree tend to share timestamps, so each thread keeps the last few
+// results keyed by the second
+#define TIME_CACHE 256
+
+static __thread struct {
+    time_t t;
+    unsigned char len;      // 0: empty slot
+    char str[63];
+} time_cache[TIME_CACHE];
+
+static const char *cached_time(time_t t, size_t *len) {
+    size_t i = (size_t)((uint64_t)t * 0x9E3779B97F4A7C15ull >> 56) & (TIME_CACHE - 1);
+    if (!time_cache[i].len || time_cache[i].t != t) {
+        size_t n = time_to_ls(t, time_cache[i].str, sizeof time_cache[i].str);
+        time_cache[i].t = t;
+        time_cache[i].len = (unsigned char)n;
+        if (n == 0) { *len = 0; return ""; }
+    }
+    *len = time_cache[i].len;
+    return time_cache[i].str;
+}
+
+// Output for one directory's listing. A worker appends the lines to buf;
+// where a subdirectory's own listing belongs it records a splice (offset
+// into buf + child node). The main thread prints the tree in walk order.
+struct outnode;
+struct splice {
+    size_t off;
+    struct outnode *child;
+};
+
+struct outnode {
+    char *buf;
+    size_t len, cap;
+    struct splice *sp;
+    size_t nsp, spcap;
+    int done;               // listing complete (guarded by out_mu)
+};
+
+static pthread_mutex_t out_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_cv = PTHREAD_COND_INITIALIZER;
+static struct outnode *out_waiting;  // node the printer is blocked on
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p) { perror("malloc"); exit(EXIT_FAILURE); }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (!p) { perror("realloc"); exit(EXIT_FAILURE); }
+    return p;
+}
+
+static struct outnode *node_new(void) {
+    struct outnode *n = xmalloc(sizeof *n);
+    memset(n, 0, sizeof *n);
+    return n;
+}
+
+static void out_write(struct outnode *o, const char *s, size_t len) {
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap : 256;
+        while (cap < o->len + len) cap *= 2;
+        o->buf = xrealloc(o->buf, cap);
+        o->cap = cap;
+    }
+    memcpy(o->buf + o->len, s, len);
+    o->len += len;
+}
+
+static void out_puts(struct outnode *o, const char *s) {
+    out_write(o, s, strlen(s));
+}
+
+static void out_char(struct outnode *o, char c) {
+    if (o->len == o->cap) out_write(o, &c, 1);
+    else o->buf[o->len++] = c;
+}
+
+// integers are formatted by hand, printf's parsing was most of -l's cost
+static void out_u64(struct outnode *o, uint64_t v) {
+    char tmp[20];
+    char *p = tmp + sizeof tmp;
+    do { *--p = (char)('0' + v % 10); v /= 10; } while (v);
+    out_write(o, p, (size_t)(tmp + sizeof tmp - p));
+}
+
+static void out_i64(struct outnode *o, int64_t v) {
+    if (v < 0) { out_char(o, '-'); out_u64(o, -(uint64_t)v); }
+    else out_u64(o, (uint64_t)v);
+}
+
+static void out_splice(struct outnode *o, struct outnode *child) {
+    if (o->nsp == o->spcap) {
+        o->spcap = o->spcap ? o->spcap * 2 : 8;
+        o->sp = xrealloc(o->sp, o->spcap * sizeof *o->sp);
+    }
+    o->sp[o->nsp].off = o->len;
+    o->sp[o->nsp].child = child;
+    o->nsp++;
+}
+
+// stdout is written with write(2) in big chunks, not through stdio
+static int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int out_error = 0;
+
+static void out_to_stdout(const char *p, size_t n) {
+    if (n && !out_error && write_all(STDOUT_FILENO, p, n) < 0) {
+        out_error = errno;
+    }
+}
+
+// -u mode: threads hand whole buffers to stdout, one at a time so a pipe
+// doesn't interleave them
+static pthread_mutex_t stdout_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void out_flush(struct outnode *o) {
+    pthread_mutex_lock(&stdout_mu);
+    out_to_stdout(o->buf, o->len);
+    pthread_mutex_unlock(&stdout_mu);
+    o->len = 0;
+}
+
+// the ordered printer gathers node pieces here before writing
+#define PRINT_BUF (1024 * 1024)
+static char *print_buf;
+static size_t print_len;
+
+static void print_out(const char *p, size_t n) {
+    if (print_len + n > PRINT_BUF) {
+        out_to_stdout(print_buf, print_len);
+        print_len = 0;
+        if (n >= PRINT_BUF) { out_to_stdout(p, n); return; }
+    }
+    memcpy(print_buf + print_len, p, n);
+    print_len += n;
+}
+
+static void node_finish(struct outnode *o) {
+    pthread_mutex_lock(&out_mu);
+    __atomic_store_n(&o->done, 1, __ATOMIC_RELEASE);
+    if (out_waiting == o) pthread_cond_signal(&out_cv);
+    pthread_mutex_unlock(&out_mu);
+}
+
+static void node_wait(struct outnode *o) {
+    pthread_mutex_lock(&out_mu);
+    out_waiting = o;
+    while (!o->done) pthread_cond_wait(&out_cv, &out_mu);
+    out_waiting = NULL;
+    pthread_mutex_unlock(&out_mu);
+}
+
+// Print the tree in walk order, waiting for listings that aren't finished
+// yet. Uses its own stack rather than recursing, since the tree is as deep
+// as the directory tree. Nodes are freed once printed.
+static void print_tree(struct outnode *root) {
+    struct frame { struct outnode *o; size_t i, pos; } *st;
+    size_t n = 0, cap = 64;
+    st = xmalloc(cap * sizeof *st);
+    print_buf = xmalloc(PRINT_BUF);
+
+    node_wait(root);
+    st[n++] = (struct frame){ root, 0, 0 };
+    while (n > 0) {
+        struct frame *f = &st[n - 1];
+        struct outnode *o = f->o;
+        if (f->i < o->nsp) {
+            struct splice *sp = &o->sp[f->i++];
+            print_out(o->buf + f->pos, sp->off - f->pos);
+            f->pos = sp->off;
+            if (!__atomic_load_n(&sp->child->done, __ATOMIC_ACQUIRE)) {
+                // about to block: let what we have go out first
+                out_to_stdout(print_buf, print_len);
+                print_len = 0;
+            }
+            node_wait(sp->child);
+            if (n == cap) {
+                cap *= 2;
+                st = xrealloc(st, cap * sizeof *st);
+            }
+            st[n++] = (struct frame){ sp->child, 0, 0 };
+            continue;
+        }
+        print_out(o->buf + f->pos, o->len - f->pos);
+        free(o->buf);
+        free(o->sp);
+        free(o);
+        n--;
     }
+    out_to_stdout(print_buf, print_len);
+    print_len = 0;
+    free(print_buf);
+    free(st);
 }
 
-// Print a line of output in -l (verbose) mode
-static void print_ls_line(const char *path, const char *name, const struct stat *sb, int is_symlink) {
-    printf("%ju ", (uintmax_t)sb->st_ino);            // inode
-    printf("%jd ", (intmax_t)(sb->st_blocks / 2));   // blocks in 1K units
+// uid/gid -> name cache for -l, shared by all threads. Lookups take the
+// read lock; a miss asks NSS outside the lock and then inserts. Ids with
+// no name are cached too (name NULL) so they don't go back to NSS.
+struct ident {
+    unsigned id;
+    int used;
+    char *name;
+};
+
+struct idcache {
+    pthread_rwlock_t lock;
+    struct ident *tab;      // open addressing, cap is a power of two
+    size_t cap, n;
+    int group;              // 1: gids, 0: uids
+};
+
+static struct idcache uid_cache = { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0 };
+static struct idcache gid_cache = { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 1 };
+
+static size_t id_slot(const struct idcache *c, unsigned id) {
+    size_t i = (id * 2654435761u) & (c->cap - 1);
+    while (c->tab[i].used && c->tab[i].id != id) i = (i + 1) & (c->cap - 1);
+    return i;
+}
+
+// NULL if the id has no entry
+static char *id_lookup(int group, unsigned id) {
+    size_t sz = 1024;
+    char *buf = NULL, *name = NULL;
+    for (;;) {
+        buf = xrealloc(buf, sz);
+        int rc;
+        if (group) {
+            struct group g, *gp = NULL;
+            rc = getgrgid_r((gid_t)id, &g, buf, sz, &gp);
+            if (rc == 0 && gp) name = strdup(gp->gr_name);
+        } else {
+            struct passwd p, *pp = NULL;
+            rc = getpwuid_r((uid_t)id, &p, buf, sz, &pp);
+            if (rc == 0 && pp) name = strdup(pp->pw_name);
+        }
+        if (rc != ERANGE || sz >= (1 << 20)) break;
+        sz *= 2;
+    }
+    free(buf);
+    return name;
+}
+
+static const char *id_name(struct idcache *c, unsigned id) {
+    pthread_rwlock_rdlock(&c->lock);
+    if (c->cap) {
+        struct ident *e = &c->tab[id_slot(c, id)];
+        if (e->used) {
+            const char *name = e->name;
+            pthread_rwlock_unlock(&c->lock);
+            return name;
+        }
+    }
+    pthread_rwlock_unlock(&c->lock);
+
+    char *name = id_lookup(c->group, id);
+
+    pthread_rwlock_wrlock(&c->lock);
+    if (2 * (c->n + 1) > c->cap) {
+        size_t oldcap = c->cap;
+        struct ident *old = c->tab;
+        c->cap = oldcap ? oldcap * 2 : 64;
+        c->tab = xmalloc(c->cap * sizeof *c->tab);
+        memset(c->tab, 0, c->cap * sizeof *c->tab);
+        for (size_t i = 0; i < oldcap; i++)
+            if (old[i].used) c->tab[id_slot(c, old[i].id)] = old[i];
+        free(old);
+    }
+    struct ident *e = &c->tab[id_slot(c, id)];
+    if (e->used) {          // another thread got here first
+        free(name);
+        name = e->name;
+    } else {
+        e->id = id;
+        e->used = 1;
+        e->name = name;
+        c->n++;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    return name;
+}
+
+// Print a line of output in -l (verbose) mode. name is relative to dirfd.
+static void print_ls_line(struct outnode *o, const char *path, int dirfd, const char *name, const struct stat *sb, int is_symlink) {
+    out_u64(o, (uint64_t)sb->st_ino);                // inode
+    out_char(o, ' ');
+    out_i64(o, (int64_t)(sb->st_blocks / 2));        // blocks in 1K units
+    out_char(o, ' ');
 
     char mstr[11];
     mode_to_string(sb->st_mode, mstr);
-    printf("%s ", mstr);
+    out_write(o, mstr, 10);
+    out_char(o, ' ');
 
-    printf("%ju ", (uintmax_t)sb->st_nlink);          // link count
+    out_u64(o, (uint64_t)sb->st_nlink);              // link count
+    out_char(o, ' ');
 
-    struct passwd *pw = getpwuid(sb->st_uid);
-    struct group  *gr = getgrgid(sb->st_gid);
-    if (pw) printf("%s ", pw->pw_name); else printf("%u ", sb->st_uid);
-    if (gr) printf("%s ", gr->gr_name); else printf("%u ", sb->st_gid);
+    const char *user = id_name(&uid_cache, sb->st_uid);
+    const char *group = id_name(&gid_cache, sb->st_gid);
+    if (user) out_puts(o, user); else out_u64(o, sb->st_uid);
+    out_char(o, ' ');
+    if (group) out_puts(o, group); else out_u64(o, sb->st_gid);
+    out_char(o, ' ');
 
     if (S_ISCHR(sb->st_mode) || S_ISBLK(sb->st_mode)) {
-        printf("%u, %u ", major(sb->st_rdev), minor(sb->st_rdev));
+        out_u64(o, major(sb->st_rdev));
+        out_write(o, ", ", 2);
+        out_u64(o, minor(sb->st_rdev));
     } else {
-        printf("%jd ", (intmax_t)sb->st_size);
+        out_i64(o, (int64_t)sb->st_size);
     }
+    out_char(o, ' ');
 
-    char tbuf[64];
-    struct timespec mt = { .tv_sec = sb->st_mtime, .tv_nsec = 0 };
-    #ifdef st_mtim
-    mt = sb->st_mtim;
-    #endif
-    time_to_ls(&mt, tbuf, sizeof tbuf);
-    printf("%s ", tbuf);
+    size_t tlen;
+    const char *tstr = cached_time(sb->st_mtime, &tlen);
+    out_write(o, tstr, tlen);
+    out_char(o, ' ');
 
-    fputs(path, stdout);
+    out_puts(o, path);
 
     if (is_symlink) {
         char tgt[PATH_MAX];
-        ssize_t n = readlink(path, tgt, sizeof(tgt)-1);
+        ssize_t n = readlinkat(dirfd, name, tgt, sizeof(tgt)-1);
         if (n >= 0) {
-            tgt[n] = '\0';
-            printf(" -> %s", tgt);
+            out_write(o, " -> ", 4);
+            out_write(o, tgt, (size_t)n);
         }
     }
-    putchar('\n');
+    out_char(o, record_end);
 }
 
-// Decide whether to print this node, depending on -n filter and -l flag
-static void visit_node(const char *dirpath, const char *name, const char *fullpath, const struct stat *sb) {
-    if (name_pat && fnmatch(name_pat, name, 0) != 0) {
-        return; // skip if it doesn’t match
-    }
-
+// Print a node that passed the filter; sb is only looked at with -l
+static void visit_node(struct outnode *o, int dirfd, const char *name, const char *fullpath, const struct stat *sb) {
     if (flag_long) {
         int is_lnk = S_ISLNK(sb->st_mode) ? 1 : 0;
-        print_ls_line(fullpath, name, sb, is_lnk);
+        print_ls_line(o, fullpath, dirfd, name, sb, is_lnk);
     } else {
-        puts(fullpath);
+        out_puts(o, fullpath);
+        out_char(o, record_end);
     }
 }
 
-// Walk through a directory recursively
-static void explore_directory(const char *dirpath) {
-    DIR *dp = opendir(dirpath);
-    if (!dp) {
-        fprintf(stderr, "Warning: Unable to open directory '%s': %s\n", dirpath, strerror(errno));
-        return;
+// -n patterns, compiled together so that many cost about as much as one:
+//  - plain literals go in a hash set of whole names
+//  - "*literal" (e.g. "*.o") goes in a hash set of suffixes, looked up once
+//    per distinct suffix length
+//  - everything else becomes one NFA over all patterns, turned into a DFA
+//    lazily as names walk it, so each name is a single pass of table lookups
+//  - the odd pattern the compiler doesn't handle ([:class:], multibyte)
+//    is left to fnmatch
+struct strset {
+    const char **s;
+    size_t *len;
+    size_t mask, n;     // mask + 1 slots, 0 means empty set
+};
+
+static uint64_t hash_bytes(const void *p, size_t n) {
+    const unsigned char *b = p;
+    uint64_t h = 0xcbf29ce484222325ull;   // FNV-1a
+    for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static void strset_grow(struct strset *set);
+
+static void strset_add(struct strset *set, const char *s, size_t len) {
+    if ((set->n + 1) * 2 > set->mask + 1 || !set->s) strset_grow(set);
+    size_t i = hash_bytes(s, len) & set->mask;
+    while (set->s[i]) {
+        if (set->len[i] == len && memcmp(set->s[i], s, len) == 0) return;
+        i = (i + 1) & set->mask;
     }
+    set->s[i] = s;
+    set->len[i] = len;
+    set->n++;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dp)) != NULL) {
-        const char *name = entry->d_name;
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
-        if (invalid_component(name)) continue;
+static void strset_grow(struct strset *set) {
+    struct strset old = *set;
+    size_t slots = set->s ? (set->mask + 1) * 2 : 16;
+    set->s = xmalloc(slots * sizeof *set->s);
+    set->len = xmalloc(slots * sizeof *set->len);
+    memset(set->s, 0, slots * sizeof *set->s);
+    set->mask = slots - 1;
+    set->n = 0;
+    for (size_t i = 0; old.s && i <= old.mask; i++)
+        if (old.s[i]) strset_add(set, old.s[i], old.len[i]);
+    free(old.s);
+    free(old.len);
+}
 
-        char fullpath[PATH_MAX];
-        if (join_path(fullpath, dirpath, name) < 0) {
-            fprintf(stderr, "Warning: path too long, skipping '%s/%s'\n", dirpath, name);
-            continue;
+static int strset_has(const struct strset *set, const char *s, size_t len) {
+    if (!set->n) return 0;
+    size_t i = hash_bytes(s, len) & set->mask;
+    while (set->s[i]) {
+        if (set->len[i] == len && memcmp(set->s[i], s, len) == 0) return 1;
+        i = (i + 1) & set->mask;
+    }
+    return 0;
+}
+
+#define DFA_STATES 4096     // past this, names fall back to stepping the NFA
+
+struct dstate {
+    int32_t next[256];      // -1 until computed, written once
+    int accept, dead;
+    uint64_t *bits;         // set of NFA states
+};
+
+struct globset {
+    int match_all;                  // some pattern was just "*"
+    struct strset exact, suffix;
+    size_t *suflens;                // distinct suffix lengths, ascending
+    int nsuflens;
+
+    // NFA: each pattern is a run of items, state k of a pattern means k
+    // items matched; a "*" item loops on itself
+    int nnfa, nwords;
+    unsigned char *star, *final;
+    unsigned char (*set)[32];       // bytes the item at each state accepts
+    uint64_t *start_bits;
+    const char **dfa_pats;          // for names fnmatch has to judge itself
+    int ndfa_pats;
+
+    // lazily built DFA; readers don't lock, new states are added under mu
+    // and published through next[] with release stores
+    struct dstate *states[DFA_STATES];
+    int nstates, start;
+    int32_t *table;                 // hash of states by NFA set
+    size_t table_mask;
+    uint64_t *scratch;
+    pthread_mutex_t mu;
+
+    const char **fallback;          // matched with fnmatch
+    int nfallback;
+    int multibyte;                  // locale where ? and [] match characters
+};
+
+static struct globset *names = NULL;    // -n / -N
+
+static void nfa_close(const struct globset *g, uint64_t *bits, int s) {
+    for (;;) {
+        bits[s / 64] |= 1ull << (s % 64);
+        if (g->final[s] || !g->star[s]) break;
+        s++;    // "*" may match nothing
+    }
+}
+
+static void nfa_step(const struct globset *g, const uint64_t *cur, uint64_t *nxt, unsigned char b) {
+    memset(nxt, 0, (size_t)g->nwords * sizeof *nxt);
+    for (int w = 0; w < g->nwords; w++) {
+        for (uint64_t m = cur[w]; m; m &= m - 1) {
+            int s = w * 64 + __builtin_ctzll(m);
+            if (g->final[s]) continue;
+            if (g->star[s]) nfa_close(g, nxt, s);
+            else if (g->set[s][b / 8] & (1u << (b % 8))) nfa_close(g, nxt, s + 1);
         }
+    }
+}
+
+static int nfa_accepts(const struct globset *g, const uint64_t *bits) {
+    for (int w = 0; w < g->nwords; w++)
+        for (uint64_t m = bits[w]; m; m &= m - 1)
+            if (g->final[w * 64 + __builtin_ctzll(m)]) return 1;
+    return 0;
+}
+
+// the id of the DFA state for bits, adding it if there's room; call with mu held
+static int dfa_state(struct globset *g, const uint64_t *bits) {
+    size_t bytes = (size_t)g->nwords * sizeof *bits;
+    size_t i = hash_bytes(bits, bytes) & g->table_mask;
+    while (g->table[i] >= 0) {
+        if (memcmp(g->states[g->table[i]]->bits, bits, bytes) == 0) return g->table[i];
+        i = (i + 1) & g->table_mask;
+    }
+    if (g->nstates == DFA_STATES) return -1;
 
-        struct stat sb;
-        if (lstat(fullpath, &sb) == -1) {
-            fprintf(stderr, "Warning: lstat failed for '%s': %s\n", fullpath, strerror(errno));
+    struct dstate *d = xmalloc(sizeof *d);
+    memset(d->next, 0xff, sizeof d->next);
+    d->bits = xmalloc(bytes);
+    memcpy(d->bits, bits, bytes);
+    d->accept = nfa_accepts(g, bits);
+    d->dead = 1;
+    for (int w = 0; w < g->nwords; w++) if (bits[w]) d->dead = 0;
+    g->states[g->nstates] = d;
+    g->table[i] = g->nstates;
+    return g->nstates++;
+}
+
+static int dfa_next(struct globset *g, int cur, unsigned char b) {
+    pthread_mutex_lock(&g->mu);
+    int nx = g->states[cur]->next[b];
+    if (nx < 0) {
+        nfa_step(g, g->states[cur]->bits, g->scratch, b);
+        nx = dfa_state(g, g->scratch);
+        if (nx >= 0) __atomic_store_n(&g->states[cur]->next[b], nx, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g->mu);
+    return nx;
+}
+
+static int dfa_match(struct globset *g, const unsigned char *p) {
+    int cur = g->start;
+    for (; *p; p++) {
+        int nx = __atomic_load_n(&g->states[cur]->next[*p], __ATOMIC_ACQUIRE);
+        if (nx < 0 && (nx = dfa_next(g, cur, *p)) < 0) {
+            // DFA is full: finish this name on the NFA
+            size_t bytes = (size_t)g->nwords * sizeof(uint64_t);
+            uint64_t *a = xmalloc(bytes), *b = xmalloc(bytes), *t;
+            memcpy(a, g->states[cur]->bits, bytes);
+            for (; *p; p++) {
+                nfa_step(g, a, b, *p);
+                t = a; a = b; b = t;
+            }
+            int r = nfa_accepts(g, a);
+            free(a);
+            free(b);
+            return r;
+        }
+        cur = nx;
+        if (g->states[cur]->dead) return 0;
+    }
+    return g->states[cur]->accept;
+}
+
+// Parse one glob into items; 0 if it needs fnmatch instead
+struct gitem {
+    unsigned char star;
+    unsigned char set[32];
+};
+
+static void set_byte(unsigned char *set, unsigned char c) {
+    set[c / 8] |= (unsigned char)(1u << (c % 8));
+}
+
+static int glob_items(const char *pat, int multibyte, struct gitem **out, int *nout) {
+    const unsigned char *p = (const unsigned char *)pat;
+    struct gitem *it = xmalloc((strlen(pat) + 1) * sizeof *it);
+    int n = 0;
+    while (*p) {
+        struct gitem g;
+        memset(&g, 0, sizeof g);
+        if (multibyte && *p >= 0x80) goto fail;
+        if (*p == '*') {
+            while (*p == '*') p++;
+            g.star = 1;
+            memset(g.set, 0xff, sizeof g.set);
+        } else if (*p == '?') {
+            p++;
+            memset(g.set, 0xff, sizeof g.set);
+        } else if (*p == '\\') {
+            if (!p[1] || (multibyte && p[1] >= 0x80)) goto fail;
+            set_byte(g.set, p[1]);
+            p += 2;
+        } else if (*p == '[') {
+            const unsigned char *q = p + 1;
+            int neg = (*q == '!' || *q == '^');
+            if (neg) q++;
+            int first = 1;
+            while (*q && (*q != ']' || first)) {
+                first = 0;
+                if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.')) goto fail;
+                unsigned char lo = *q++;
+                if (lo == '\\') { if (!*q) goto fail; lo = *q++; }
+                unsigned char hi = lo;
+                if (*q == '-' && q[1] && q[1] != ']') {
+                    q++;
+                    hi = *q++;
+                    if (hi == '\\') { if (!*q) goto fail; hi = *q++; }
+                    if (hi < lo) goto fail;
+                }
+                if (multibyte && (lo >= 0x80 || hi >= 0x80)) goto fail;
+                for (unsigned c = lo; c <= hi; c++) set_byte(g.set, (unsigned char)c);
+            }
+            if (!*q) goto fail;     // no closing ']': let fnmatch decide
+            if (neg)
+                for (int i = 0; i < 32; i++) g.set[i] = (unsigned char)~g.set[i];
+            p = q + 1;
+        } else {
+            set_byte(g.set, *p++);
+        }
+        it[n++] = g;
+    }
+    *out = it;
+    *nout = n;
+    return 1;
+fail:
+    free(it);
+    return 0;
+}
+
+// single byte an item matches, or -1
+static int item_literal(const struct gitem *g) {
+    if (g->star) return -1;
+    int c = -1;
+    for (int i = 0; i < 256; i++) {
+        if (g->set[i / 8] & (1u << (i % 8))) {
+            if (c >= 0) return -1;
+            c = i;
+        }
+    }
+    return c;
+}
+
+static struct globset *globset_build(const char **pats, int npats) {
+    struct globset *g = xmalloc(sizeof *g);
+    memset(g, 0, sizeof *g);
+    pthread_mutex_init(&g->mu, NULL);
+    g->multibyte = MB_CUR_MAX > 1;
+
+    struct gitem **items = xmalloc((size_t)npats * sizeof *items);
+    int *nitems = xmalloc((size_t)npats * sizeof *nitems);
+    g->fallback = xmalloc((size_t)npats * sizeof *g->fallback);
+    g->dfa_pats = xmalloc((size_t)npats * sizeof *g->dfa_pats);
+
+    for (int i = 0; i < npats; i++) {
+        items[i] = NULL;
+        if (!glob_items(pats[i], g->multibyte, &items[i], &nitems[i])) {
+            g->fallback[g->nfallback++] = pats[i];
             continue;
         }
+        // "*" then literals only: exact (no star) or suffix
+        struct gitem *it = items[i];
+        int n = nitems[i], lead = (n > 0 && it[0].star), k;
+        char *lit = xmalloc((size_t)n + 1);
+        for (k = lead; k < n; k++) {
+            int c = item_literal(&it[k]);
+            if (c < 0) break;
+            lit[k - lead] = (char)c;
+        }
+        if (k < n) {
+            free(lit);
+            g->dfa_pats[g->ndfa_pats] = pats[i];
+            items[g->ndfa_pats] = items[i];     // compact the DFA ones to the front
+            nitems[g->ndfa_pats++] = n;
+            continue;
+        }
+        free(items[i]);
+        size_t len = (size_t)(n - lead);
+        if (!lead) {
+            strset_add(&g->exact, lit, len);
+        } else if (len == 0) {
+            g->match_all = 1;
+        } else {
+            strset_add(&g->suffix, lit, len);
+            int j = 0;
+            while (j < g->nsuflens && g->suflens[j] < len) j++;
+            if (j == g->nsuflens || g->suflens[j] != len) {
+                g->suflens = xrealloc(g->suflens, (size_t)(g->nsuflens + 1) * sizeof *g->suflens);
+                memmove(g->suflens + j + 1, g->suflens + j, (size_t)(g->nsuflens - j) * sizeof *g->suflens);
+                g->suflens[j] = len;
+                g->nsuflens++;
+            }
+        }
+    }
+
+    if (g->ndfa_pats) {
+        for (int i = 0; i < g->ndfa_pats; i++) g->nnfa += nitems[i] + 1;
+        g->nwords = (g->nnfa + 63) / 64;
+        g->star = xmalloc((size_t)g->nnfa);
+        g->final = xmalloc((size_t)g->nnfa);
+        g->set = xmalloc((size_t)g->nnfa * sizeof *g->set);
+        g->start_bits = xmalloc((size_t)g->nwords * sizeof(uint64_t));
+        g->scratch = xmalloc((size_t)g->nwords * sizeof(uint64_t));
+        memset(g->start_bits, 0, (size_t)g->nwords * sizeof(uint64_t));
+        int s = 0;
+        for (int i = 0; i < g->ndfa_pats; i++) {
+            int base = s;
+            for (int k = 0; k < nitems[i]; k++, s++) {
+                g->star[s] = items[i][k].star;
+                g->final[s] = 0;
+                memcpy(g->set[s], items[i][k].set, 32);
+            }
+            g->star[s] = 0;
+            g->final[s] = 1;
+            memset(g->set[s], 0, 32);
+            s++;
+            nfa_close(g, g->start_bits, base);
+            free(items[i]);
+        }
+        g->table_mask = 2 * DFA_STATES - 1;
+        g->table = xmalloc(2 * DFA_STATES * sizeof *g->table);
+        memset(g->table, 0xff, 2 * DFA_STATES * sizeof *g->table);
+        g->start = dfa_state(g, g->start_bits);
+    }
+    free(items);
+    free(nitems);
+    return g;
+}
+
+static int has_high_byte(const char *s) {
+    for (; *s; s++) if ((unsigned char)*s >= 0x80) return 1;
+    return 0;
+}
+
+static int globset_match(struct globset *g, const char *name) {
+    if (g->match_all) return 1;
+    size_t len = strlen(name);
+    if (strset_has(&g->exact, name, len)) return 1;
+    for (int i = 0; i < g->nsuflens && g->suflens[i] <= len; i++)
+        if (strset_has(&g->suffix, name + len - g->suflens[i], g->suflens[i])) return 1;
+    if (g->ndfa_pats) {
+        if (g->multibyte && has_high_byte(name)) {
+            // ? and [] match whole characters here, which the DFA doesn't know
+            for (int i = 0; i < g->ndfa_pats; i++)
+                if (fnmatch(g->dfa_pats[i], name, 0) == 0) return 1;
+        } else if (dfa_match(g, (const unsigned char *)name)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < g->nfallback; i++)
+        if (fnmatch(g->fallback[i], name, 0) == 0) return 1;
+    return 0;
+}
+
+// -N: one pattern per line
+static void read_patterns(const char *file, const char ***pats, int *npats) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open pattern file '%s': %s\n", file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) != -1) {
+        if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+        if (n == 0) continue;
+        *pats = xrealloc(*pats, (size_t)(*npats + 1) * sizeof **pats);
+        (*pats)[(*npats)++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+}
+
+// Expression after the starting path, find-style:
+//   -name PAT  -regex ERE  -type [fdlbcps]  -size [+-]N[ckMG]  -mtime [+-]N
+//   -newer FILE  -user NAME|UID  -prune  -true
+//   ( EXPR )  ! EXPR  -not EXPR  EXPR [-a|-and] EXPR  EXPR -o|-or EXPR
+// Each entry is first evaluated with only its name and d_type. Tests that
+// need stat data answer "unknown" then, and only entries whose result is
+// still unknown get stat'ed and evaluated again. The operands of -a/-o
+// lists are sorted so the cheap tests come first.
+// -regex takes a POSIX extended regex (like find -regextype posix-extended),
+// not find's default emacs syntax: a|b, (a), a+, a? and a{2} are operators,
+// \| \( \+ \? \{ are literal characters.
+enum pred_kind {
+    P_AND, P_OR, P_NOT, P_TRUE, P_PRUNE,
+    P_NAME, P_TYPE, P_REGEX,                    // no stat needed
+    P_SIZE, P_MTIME, P_NEWER, P_USER,           // need stat
+};
+
+struct pred {
+    enum pred_kind kind;
+    int cost;               // rough relative cost, for ordering -a/-o operands
+    int has_prune;          // -prune somewhere below: don't reorder around it
+    struct pred **kids;     // P_AND / P_OR operands, P_NOT's one operand
+    int nkids;
+    const char *pat;        // P_NAME
+    mode_t type;            // P_TYPE, S_IF* bits
+    char cmp;               // P_SIZE / P_MTIME: '+', '-' or '='
+    int64_t num, unit;      // P_SIZE in units of unit bytes, P_MTIME in days
+    struct timespec t;      // P_NEWER
+    uid_t uid;              // P_USER
+    regex_t re;             // P_REGEX
+};
+
+struct evalctx {
+    const char *name;
+    const char *path;       // needed by -regex
+    unsigned char dt;       // DT_UNKNOWN if readdir didn't say
+    const struct stat *sb;  // NULL until the entry has been stat'ed
+    int prune;              // -prune was reached
+};
+
+static struct pred *expr = NULL;    // NULL matches everything
+static int expr_uses_path = 0;      // -regex present, build paths up front
+
+static mode_t dt_to_mode(unsigned char dt) {
+    switch (dt) {
+        case DT_REG:  return S_IFREG;
+        case DT_DIR:  return S_IFDIR;
+        case DT_LNK:  return S_IFLNK;
+        case DT_BLK:  return S_IFBLK;
+        case DT_CHR:  return S_IFCHR;
+        case DT_FIFO: return S_IFIFO;
+        case DT_SOCK: return S_IFSOCK;
+        default:      return 0;
+    }
+}
+
+static int cmp_num(char cmp, int64_t have, int64_t want) {
+    if (cmp == '+') return have > want;
+    if (cmp == '-') return have < want;
+    return have == want;
+}
+
+// 1 true, 0 false, -1 can't tell without stat data
+static int pred_eval(const struct pred *p, struct evalctx *c) {
+    switch (p->kind) {
+    case P_AND:
+    case P_OR: {
+        int stop = (p->kind == P_OR);   // value that decides the whole list
+        int r = !stop;
+        for (int i = 0; i < p->nkids; i++) {
+            int v = pred_eval(p->kids[i], c);
+            if (v == stop) return v;
+            if (v < 0) {
+                r = -1;
+                // later operands may still decide it, unless this one or
+                // one after it could prune
+                for (int j = i; j < p->nkids; j++)
+                    if (p->kids[j]->has_prune) return -1;
+            }
+        }
+        return r;
+    }
+    case P_NOT: {
+        int v = pred_eval(p->kids[0], c);
+        return v < 0 ? -1 : !v;
+    }
+    case P_TRUE:
+        return 1;
+    case P_PRUNE:
+        c->prune = 1;
+        return 1;
+    case P_NAME:
+        return fnmatch(p->pat, c->name, 0) == 0;
+    case P_REGEX:
+        return regexec(&p->re, c->path, 0, NULL, 0) == 0;
+    case P_TYPE:
+        if (c->sb) return (c->sb->st_mode & S_IFMT) == p->type;
+        if (c->dt != DT_UNKNOWN) return dt_to_mode(c->dt) == p->type;
+        return -1;
+    default:
+        break;
+    }
+
+    if (!c->sb) return -1;
+    const struct stat *sb = c->sb;
+    switch (p->kind) {
+    case P_SIZE: {
+        int64_t units = ((int64_t)sb->st_size + p->unit - 1) / p->unit;  // rounded up, like find
+        return cmp_num(p->cmp, units, p->num);
+    }
+    case P_MTIME: {
+        int64_t days = (int64_t)(now_time - sb->st_mtime);
+        days = (days >= 0) ? days / 86400 : -((-days + 86399) / 86400);
+        return cmp_num(p->cmp, days, p->num);
+    }
+    case P_NEWER:
+        return sb->st_mtim.tv_sec > p->t.tv_sec ||
+               (sb->st_mtim.tv_sec == p->t.tv_sec && sb->st_mtim.tv_nsec > p->t.tv_nsec);
+    case P_USER:
+        return sb->st_uid == p->uid;
+    default:
+        return 1;
+    }
+}
+
+// ---- parsing ----
+
+static char **ex_argv;
+static int ex_argc, ex_pos;
+
+static void ex_fail(const char *msg, const char *arg) {
+    fprintf(stderr, "Error: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+    exit(EXIT_FAILURE);
+}
+
+static const char *ex_peek(void) {
+    return ex_pos < ex_argc ? ex_argv[ex_pos] : NULL;
+}
+
+static const char *ex_arg(const char *opt) {
+    if (ex_pos >= ex_argc) ex_fail("missing argument to", opt);
+    return ex_argv[ex_pos++];
+}
+
+static struct pred *pred_new(enum pred_kind kind, int cost) {
+    struct pred *p = xmalloc(sizeof *p);
+    memset(p, 0, sizeof *p);
+    p->kind = kind;
+    p->cost = cost;
+    p->has_prune = (kind == P_PRUNE);
+    return p;
+}
+
+static void pred_add(struct pred *list, struct pred *kid) {
+    list->kids = xrealloc(list->kids, (size_t)(list->nkids + 1) * sizeof *list->kids);
+    list->kids[list->nkids++] = kid;
+    list->cost += kid->cost;
+    list->has_prune |= kid->has_prune;
+}
+
+// [+-]N with an optional unit suffix from units (scale gives each one's size)
+static void parse_num(struct pred *p, const char *opt, const char *s,
+                      const char *units, const int64_t *scale, int64_t dflt) {
+    p->cmp = '=';
+    if (*s == '+' || *s == '-') p->cmp = *s++;
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || errno || v < 0) ex_fail("bad number for", opt);
+    p->num = v;
+    p->unit = dflt;
+    if (*end) {
+        const char *u = strchr(units, *end);
+        if (!u || end[1]) ex_fail("bad unit for", opt);
+        p->unit = scale[u - units];
+    }
+}
+
+static struct pred *parse_or(void);
+
+static struct pred *parse_primary(void) {
+    const char *tok = ex_peek();
+    if (!tok) ex_fail("expression expected", NULL);
+    ex_pos++;
+
+    if (strcmp(tok, "(") == 0) {
+        struct pred *p = parse_or();
+        const char *close = ex_peek();
+        if (!close || strcmp(close, ")") != 0) ex_fail("missing )", NULL);
+        ex_pos++;
+        return p;
+    }
+    if (strcmp(tok, "-true") == 0) return pred_new(P_TRUE, 0);
+    if (strcmp(tok, "-prune") == 0) return pred_new(P_PRUNE, 0);
+    if (strcmp(tok, "-name") == 0) {
+        struct pred *p = pred_new(P_NAME, 1);
+        p->pat = ex_arg(tok);
+        return p;
+    }
+    if (strcmp(tok, "-regex") == 0) {
+        const char *re = ex_arg(tok);
+        // like find, the regex has to match the whole path; it's ERE though
+        size_t n = strlen(re);
+        char *anchored = xmalloc(n + 5);
+        snprintf(anchored, n + 5, "^(%s)$", re);
+        struct pred *p = pred_new(P_REGEX, 3);
+        if (regcomp(&p->re, anchored, REG_EXTENDED | REG_NOSUB) != 0) ex_fail("bad regex", re);
+        free(anchored);
+        expr_uses_path = 1;
+        return p;
+    }
+    if (strcmp(tok, "-type") == 0) {
+        const char *t = ex_arg(tok);
+        static const char letters[] = "fdlbcps";
+        static const mode_t modes[] = { S_IFREG, S_IFDIR, S_IFLNK, S_IFBLK, S_IFCHR, S_IFIFO, S_IFSOCK };
+        const char *l = t[0] ? strchr(letters, t[0]) : NULL;
+        if (!l || t[1]) ex_fail("bad -type", t);
+        struct pred *p = pred_new(P_TYPE, 1);
+        p->type = modes[l - letters];
+        return p;
+    }
+    if (strcmp(tok, "-size") == 0) {
+        static const int64_t scale[] = { 1, 512, 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+        struct pred *p = pred_new(P_SIZE, 10);
+        parse_num(p, tok, ex_arg(tok), "cbkMG", scale, 512);
+        return p;
+    }
+    if (strcmp(tok, "-mtime") == 0) {
+        static const int64_t scale[] = { 1 };
+        struct pred *p = pred_new(P_MTIME, 10);
+        parse_num(p, tok, ex_arg(tok), "", scale, 1);
+        return p;
+    }
+    if (strcmp(tok, "-newer") == 0) {
+        const char *ref = ex_arg(tok);
+        struct stat rs;
+        if (stat(ref, &rs) == -1) ex_fail("cannot stat -newer file", ref);
+        struct pred *p = pred_new(P_NEWER, 10);
+        p->t = rs.st_mtim;
+        return p;
+    }
+    if (strcmp(tok, "-user") == 0) {
+        const char *u = ex_arg(tok);
+        struct pred *p = pred_new(P_USER, 10);
+        struct passwd *pw = getpwnam(u);  // still single-threaded here
+        char *end;
+        if (pw) {
+            p->uid = pw->pw_uid;
+        } else {
+            unsigned long v = strtoul(u, &end, 10);
+            if (!*u || *end) ex_fail("no such user", u);
+            p->uid = (uid_t)v;
+        }
+        return p;
+    }
+    ex_fail("unknown expression", tok);
+    return NULL;
+}
+
+static struct pred *parse_not(void) {
+    const char *tok = ex_peek();
+    if (tok && (strcmp(tok, "!") == 0 || strcmp(tok, "-not") == 0)) {
+        ex_pos++;
+        struct pred *p = pred_new(P_NOT, 0);
+        pred_add(p, parse_not());
+        return p;
+    }
+    return parse_primary();
+}
+
+static int is_tok(const char *tok, const char *a, const char *b) {
+    return tok && (strcmp(tok, a) == 0 || strcmp(tok, b) == 0);
+}
+
+// cheapest first, but nothing moves across an operand that can -prune
+static void order_by_cost(struct pred *list) {
+    int i = 0;
+    while (i < list->nkids) {
+        int j = i;
+        while (j < list->nkids && !list->kids[j]->has_prune) j++;
+        // insertion sort of [i, j), stable
+        for (int a = i + 1; a < j; a++) {
+            struct pred *k = list->kids[a];
+            int b = a;
+            while (b > i && list->kids[b - 1]->cost > k->cost) {
+                list->kids[b] = list->kids[b - 1];
+                b--;
+            }
+            list->kids[b] = k;
+        }
+        i = j + 1;
+    }
+}
+
+static struct pred *parse_and(void) {
+    struct pred *first = parse_not();
+    struct pred *list = NULL;
+    for (;;) {
+        const char *tok = ex_peek();
+        if (!tok || is_tok(tok, "-o", "-or") || strcmp(tok, ")") == 0) break;
+        if (is_tok(tok, "-a", "-and")) ex_pos++;
+        if (!list) {
+            list = pred_new(P_AND, 0);
+            pred_add(list, first);
+        }
+        pred_add(list, parse_not());
+    }
+    if (!list) return first;
+    order_by_cost(list);
+    return list;
+}
+
+static struct pred *parse_or(void) {
+    struct pred *first = parse_and();
+    struct pred *list = NULL;
+    while (is_tok(ex_peek(), "-o", "-or")) {
+        ex_pos++;
+        if (!list) {
+            list = pred_new(P_OR, 0);
+            pred_add(list, first);
+        }
+        pred_add(list, parse_and());
+    }
+    if (!list) return first;
+    order_by_cost(list);
+    return list;
+}
+
+static struct pred *parse_expr(int argc, char **argv) {
+    ex_argc = argc;
+    ex_argv = argv;
+    ex_pos = 0;
+    struct pred *p = parse_or();
+    if (ex_pos < ex_argc) ex_fail("unexpected", ex_argv[ex_pos]);
+    return p;
+}
+
+// could this argument start an expression?
+static int starts_expr(const char *arg) {
+    static const char *const toks[] = {
+        "(", "!", "-not", "-true", "-prune", "-name", "-regex", "-type",
+        "-size", "-mtime", "-newer", "-user", NULL
+    };
+    for (int i = 0; toks[i]; i++)
+        if (strcmp(arg, toks[i]) == 0) return 1;
+    return 0;
+}
+
+// the expression, then the -n filter on top of it
+static int eval_entry(struct evalctx *c) {
+    c->prune = 0;
+    int r = expr ? pred_eval(expr, c) : 1;
+    if (r != 0 && names && !globset_match(names, c->name)) {
+        // -n only decides what gets printed; an unknown that could still
+        // -prune has to be settled after the stat
+        if (r > 0 || !expr->has_prune) r = 0;
+    }
+    return r;
+}
+
+// -I index: a snapshot of every directory the last run read, so this run
+// only rereads the ones whose mtime or ctime has moved. Layout, native-endian:
+//   struct snap_hdr
+//   struct snap_dir [ndirs], sorted by (dev, ino)
+//   entries: per directory, nents of { d_type byte, name, NUL }
+// The file is mmap'ed and used in place. A directory's listing only changes
+// along with its mtime, so an unchanged one is answered from here; stat
+// data is never kept, entries that need it are still stat'ed. mtime can be
+// set back with utimes() after a change, ctime can't, so both must match.
+#define SNAP_MAGIC "SFINDEX2"
+
+struct snap_hdr {
+    char magic[8];
+    uint64_t ndirs;
+    uint64_t ents_len;
+    uint64_t pad;
+};
+
+struct snap_dir {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec;  // nsec -1: don't trust this one
+    int64_t ctime_sec, ctime_nsec;  // likewise
+    uint64_t off, nents;            // into the entries
+};
+
+struct snapshot {
+    const struct snap_dir *dirs;
+    uint64_t ndirs;
+    const char *ents, *ents_end;
+};
+
+static const char *index_path = NULL;   // -I file
+static struct snapshot old_snap;        // what the last run left, may be empty
+
+static void snap_load(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) fprintf(stderr, "Warning: cannot open index '%s': %s\n", file, strerror(errno));
+        return;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct snap_hdr))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Warning: ignoring bad index '%s'\n", file);
+        return;
+    }
+    const struct snap_hdr *h = map;
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t dirs_end = sizeof *h + h->ndirs * sizeof(struct snap_dir);
+    if (memcmp(h->magic, SNAP_MAGIC, 8) != 0 || h->ndirs > size / sizeof(struct snap_dir) ||
+        dirs_end > size || h->ents_len != size - dirs_end) {
+        fprintf(stderr, "Warning: ignoring bad index '%s'\n", file);
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+    old_snap.dirs = (const struct snap_dir *)(h + 1);
+    old_snap.ndirs = h->ndirs;
+    old_snap.ents = (const char *)map + dirs_end;
+    old_snap.ents_end = old_snap.ents + h->ents_len;
+}
+
+static int snap_cmp(uint64_t dev, uint64_t ino, const struct snap_dir *sd) {
+    if (dev != sd->dev) return dev < sd->dev ? -1 : 1;
+    if (ino != sd->ino) return ino < sd->ino ? -1 : 1;
+    return 0;
+}
+
+// the old entry list for the directory sb describes if it's still current
+static const struct snap_dir *snap_find(const struct stat *sb) {
+    uint64_t dev = (uint64_t)sb->st_dev, ino = (uint64_t)sb->st_ino;
+    uint64_t lo = 0, hi = old_snap.ndirs;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int c = snap_cmp(dev, ino, &old_snap.dirs[mid]);
+        if (c == 0) {
+            const struct snap_dir *sd = &old_snap.dirs[mid];
+            if (sd->mtime_sec != (int64_t)sb->st_mtim.tv_sec || sd->mtime_nsec != (int64_t)sb->st_mtim.tv_nsec ||
+                sd->ctime_sec != (int64_t)sb->st_ctim.tv_sec || sd->ctime_nsec != (int64_t)sb->st_ctim.tv_nsec)
+                return NULL;
+            // make sure the names really are inside the file before using them
+            if (sd->off > (uint64_t)(old_snap.ents_end - old_snap.ents)) return NULL;
+            const char *p = old_snap.ents + sd->off;
+            for (uint64_t i = 0; i < sd->nents; i++) {
+                if (p >= old_snap.ents_end) return NULL;
+                const char *nul = memchr(p + 1, '\0', (size_t)(old_snap.ents_end - p - 1));
+                if (!nul) return NULL;
+                p = nul + 1;
+            }
+            return sd;
+        }
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return NULL;
+}
+
+// this run's snapshot, collected per worker and merged at the end
+struct snapwriter {
+    struct snap_dir *dirs;
+    size_t ndirs, dcap;
+    char *ents;
+    size_t elen, ecap;
+};
+
+// append one entry, returning where its type byte went
+static size_t snap_add_entry(struct snapwriter *sw, unsigned char dt, const char *name) {
+    size_t n = strlen(name) + 2;
+    if (sw->elen + n > sw->ecap) {
+        sw->ecap = (sw->elen + n) * 2;
+        sw->ents = xrealloc(sw->ents, sw->ecap);
+    }
+    size_t at = sw->elen;
+    sw->ents[at] = (char)dt;
+    memcpy(sw->ents + at + 1, name, n - 1);
+    sw->elen += n;
+    return at;
+}
+
+static void snap_add_dir(struct snapwriter *sw, const struct stat *sb, size_t off, uint64_t nents) {
+    if (sw->ndirs == sw->dcap) {
+        sw->dcap = sw->dcap ? sw->dcap * 2 : 64;
+        sw->dirs = xrealloc(sw->dirs, sw->dcap * sizeof *sw->dirs);
+    }
+    struct snap_dir *sd = &sw->dirs[sw->ndirs++];
+    memset(sd, 0, sizeof *sd);
+    sd->dev = (uint64_t)sb->st_dev;
+    sd->ino = (uint64_t)sb->st_ino;
+    sd->mtime_sec = (int64_t)sb->st_mtim.tv_sec;
+    // a change later in the same second as our read could keep this mtime,
+    // so a directory touched since the run started gets reread next time
+    sd->mtime_nsec = (sb->st_mtim.tv_sec >= now_time) ? -1 : (int64_t)sb->st_mtim.tv_nsec;
+    sd->ctime_sec = (int64_t)sb->st_ctim.tv_sec;
+    sd->ctime_nsec = (sb->st_ctim.tv_sec >= now_time) ? -1 : (int64_t)sb->st_ctim.tv_nsec;
+    sd->off = off;
+    sd->nents = nents;
+}
+
+static int snap_dir_order(const void *a, const void *b) {
+    const struct snap_dir *x = a;
+    return snap_cmp(x->dev, x->ino, b);
+}
+
+// merge the writers and replace the index file
+static int snap_save(const char *file, struct snapwriter **sws, int n) {
+    struct snap_hdr h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    for (int i = 0; i < n; i++) {
+        h.ndirs += sws[i]->ndirs;
+        h.ents_len += sws[i]->elen;
+    }
+    struct snap_dir *dirs = xmalloc((h.ndirs ? h.ndirs : 1) * sizeof *dirs);
+    uint64_t nd = 0, base = 0;
+    for (int i = 0; i < n; i++) {
+        for (size_t k = 0; k < sws[i]->ndirs; k++) {
+            dirs[nd] = sws[i]->dirs[k];
+            dirs[nd++].off += base;
+        }
+        base += sws[i]->elen;
+    }
+    qsort(dirs, (size_t)nd, sizeof *dirs, snap_dir_order);
+
+    size_t tlen = strlen(file) + 5;
+    char *tmp = xmalloc(tlen);
+    snprintf(tmp, tlen, "%s.tmp", file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write_all(fd, (const char *)&h, sizeof h) == 0 &&
+             write_all(fd, (const char *)dirs, (size_t)nd * sizeof *dirs) == 0;
+    for (int i = 0; ok && i < n; i++)
+        ok = write_all(fd, sws[i]->ents, sws[i]->elen) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (ok && rename(tmp, file) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Warning: cannot write index '%s': %s\n", file, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+    free(dirs);
+    return ok ? 0 : -1;
+}
+
+// A directory in the walk. Directories are opened with openat relative to
+// their parent, so neither depth nor path length is limited by PATH_MAX.
+// Each child dnode holds a reference on its parent, which keeps the
+// parent's path and cached fd around until the children are done.
+// -D totals; a dnode's cover its whole subtree once it's released
+struct dusum {
+    uint64_t blocks, bytes, files;
+};
+
+struct dnode {
+    struct dnode *parent;
+    char *path;             // full path, for printing
+    size_t pathlen;
+    const char *name;       // last component (in path); the root uses the whole path
+    int fd;                 // cached directory fd, or -1
+    int refs;
+    int du_self;            // -D: the directory itself is counted
+    struct dusum du;
+    struct outnode *du_tail;    // -D: where its line goes in ordered mode
+};
+
+// Parents keep their fd cached while their children are queued, as long as
+// the total stays under fd_budget (set from RLIMIT_NOFILE). Past that a
+// child reopens its way down from the nearest ancestor that has one.
+static long open_fds = 0;
+static long fd_budget = 0;
+
+static struct dnode *dn_new(struct dnode *parent, const char *name) {
+    struct dnode *d = xmalloc(sizeof *d);
+    size_t nlen = strlen(name);
+    if (parent) {
+        d->pathlen = parent->pathlen + 1 + nlen;
+        d->path = xmalloc(d->pathlen + 1);
+        memcpy(d->path, parent->path, parent->pathlen);
+        d->path[parent->pathlen] = '/';
+        memcpy(d->path + parent->pathlen + 1, name, nlen + 1);
+        d->name = d->path + parent->pathlen + 1;
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    } else {
+        d->pathlen = nlen;
+        d->path = xmalloc(nlen + 1);
+        memcpy(d->path, name, nlen + 1);
+        d->name = d->path;
+    }
+    d->parent = parent;
+    d->fd = -1;
+    d->refs = 1;
+    d->du_self = 1;
+    memset(&d->du, 0, sizeof d->du);
+    d->du_tail = NULL;
+    return d;
+}
+
+static void du_release(struct dnode *d);
+
+static void dn_put(struct dnode *d) {
+    while (d && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct dnode *p = d->parent;
+        if (flag_du) du_release(d);
+        if (d->fd >= 0) {
+            close(d->fd);
+            __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+        }
+        free(d->path);
+        free(d);
+        d = p;
+    }
+}
+
+// Try to keep fd as d's cached fd. Returns the fd to use from now on;
+// *owned says whether the caller still has to close it.
+static int dn_cache(struct dnode *d, int fd, int *owned) {
+    *owned = 1;
+    if (__atomic_add_fetch(&open_fds, 1, __ATOMIC_RELAXED) > fd_budget) {
+        __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+        return fd;
+    }
+    int cached = -1;
+    *owned = 0;
+    if (__atomic_compare_exchange_n(&d->fd, &cached, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return fd;
+    // another thread cached one first
+    __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+    close(fd);
+    return cached;
+}
+
+// An fd for d's directory: its cached one, or a fresh one (*owned set)
+// opened down the chain from the nearest ancestor with a cached fd, or
+// from the start path. Ancestors opened on the way get cached if the
+// budget allows, since their other children will want them too.
+static int dn_open(struct dnode *d, int *owned) {
+    int fd = __atomic_load_n(&d->fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) { *owned = 0; return fd; }
+
+    size_t n = 0;
+    struct dnode *a;
+    for (a = d; a && __atomic_load_n(&a->fd, __ATOMIC_ACQUIRE) < 0; a = a->parent) n++;
+    struct dnode **chain = xmalloc(n * sizeof *chain);
+    a = d;
+    for (size_t i = 0; i < n; i++, a = a->parent) chain[i] = a;
+
+    int cur = a ? __atomic_load_n(&a->fd, __ATOMIC_ACQUIRE) : AT_FDCWD;
+    int cur_owned = 0;
+    for (size_t i = n; i-- > 0; ) {
+        int nfd = openat(cur, chain[i]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int err = errno;
+        if (cur_owned) close(cur);
+        if (nfd < 0) { free(chain); errno = err; return -1; }
+        if (i == 0) { cur = nfd; cur_owned = 1; }
+        else cur = dn_cache(chain[i], nfd, &cur_owned);
+    }
+    free(chain);
+    *owned = cur_owned;
+    return cur;
+}
 
-        visit_node(dirpath, name, fullpath, &sb);
+// A directory still to be read, and the node its listing goes into
+// (NULL in -u mode, where each worker prints through its own buffer).
+struct dirtask {
+    struct dnode *dn;
+    struct outnode *out;
+};
 
-        if (S_ISDIR(sb.st_mode)) {
-            if (flag_xdev && start_dev != (dev_t)-1 && sb.st_dev != start_dev) {
-                continue; // don’t cross to another device
+// Work-stealing deque, one per thread. The owner pushes and pops at the
+// bottom (LIFO, so it walks depth-first); idle threads steal from the top,
+// which holds the shallowest directories and so the biggest subtrees.
+struct deque {
+    pthread_mutex_t mu;
+    struct dirtask **items;  // ring buffer, cap is a power of two
+    size_t head, tail, cap;
+};
+
+static void deque_push(struct deque *d, struct dirtask *t) {
+    pthread_mutex_lock(&d->mu);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        struct dirtask **items = xmalloc(cap * sizeof *items);
+        for (size_t i = d->head; i != d->tail; i++)
+            items[i & (cap - 1)] = d->items[i & (d->cap - 1)];
+        free(d->items);
+        d->items = items;
+        d->cap = cap;
+    }
+    d->items[d->tail++ & (d->cap - 1)] = t;
+    pthread_mutex_unlock(&d->mu);
+}
+
+static struct dirtask *deque_pop(struct deque *d) {
+    struct dirtask *t = NULL;
+    pthread_mutex_lock(&d->mu);
+    if (d->tail != d->head) t = d->items[--d->tail & (d->cap - 1)];
+    pthread_mutex_unlock(&d->mu);
+    return t;
+}
+
+static struct dirtask *deque_steal(struct deque *d) {
+    struct dirtask *t = NULL;
+    pthread_mutex_lock(&d->mu);
+    if (d->tail != d->head) t = d->items[d->head++ & (d->cap - 1)];
+    pthread_mutex_unlock(&d->mu);
+    return t;
+}
+
+// Directory reading. On Linux this is getdents64 straight into a big
+// per-thread buffer, handing out names in place; elsewhere it's readdir.
+#define DENT_BUF (1024 * 1024)
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+struct dirreader {
+    int fd;
+    const char *snap;       // reading a -I snapshot entry list instead
+    uint64_t snap_left;
+#ifdef __linux__
+    char *buf;
+    long len, pos;
+#else
+    DIR *dp;
+#endif
+};
+
+// fd stays the caller's; buf must hold DENT_BUF bytes
+static int dr_open(struct dirreader *dr, int fd, char *buf) {
+    dr->fd = fd;
+    dr->snap = NULL;
+#ifdef __linux__
+    dr->buf = buf;
+    dr->len = dr->pos = 0;
+    return 0;
+#else
+    (void)buf;
+    int dfd = dup(fd);
+    dr->dp = (dfd >= 0) ? fdopendir(dfd) : NULL;
+    if (!dr->dp && dfd >= 0) close(dfd);
+    return dr->dp ? 0 : -1;
+#endif
+}
+
+// hand out a snapshot's entries, checked by snap_find, instead of reading
+static void dr_open_snap(struct dirreader *dr, const struct snap_dir *sd) {
+    memset(dr, 0, sizeof *dr);
+    dr->fd = -1;
+    dr->snap = old_snap.ents + sd->off;
+    dr->snap_left = sd->nents;
+}
+
+// next entry: 1 with *name/*type set, 0 at the end, -1 on error (errno)
+static int dr_next(struct dirreader *dr, const char **name, unsigned char *type) {
+    if (dr->snap) {
+        if (!dr->snap_left) return 0;
+        dr->snap_left--;
+        *type = (unsigned char)dr->snap[0];
+        *name = dr->snap + 1;
+        dr->snap += strlen(*name) + 2;
+        return 1;
+    }
+#ifdef __linux__
+    if (dr->pos >= dr->len) {
+        long n = syscall(SYS_getdents64, dr->fd, dr->buf, DENT_BUF);
+        if (n <= 0) return (n == 0) ? 0 : -1;
+        dr->len = n;
+        dr->pos = 0;
+    }
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(dr->buf + dr->pos);
+    dr->pos += d->d_reclen;
+    *name = d->d_name;
+    *type = d->d_type;
+    return 1;
+#else
+    errno = 0;
+    struct dirent *d = readdir(dr->dp);
+    if (!d) return errno ? -1 : 0;
+    *name = d->d_name;
+    *type = d->d_type;
+    return 1;
+#endif
+}
+
+// true if the next dr_next won't refill the buffer, i.e. names handed out
+// so far are still valid
+static int dr_more(const struct dirreader *dr) {
+    if (dr->snap) return 1;     // the mapping never moves
+#ifdef __linux__
+    return dr->pos < dr->len;
+#else
+    (void)dr;
+    return 0;
+#endif
+}
+
+static void dr_close(struct dirreader *dr) {
+#ifdef __linux__
+    (void)dr;
+#else
+    if (!dr->snap) closedir(dr->dp);
+#endif
+}
+
+// Entries of a directory are handled STAT_BATCH at a time: their names
+// (still in the dirreader buffer) are collected, whatever needs stat data
+// is stat'ed together, then they're printed in order. With -a the stats
+// of a batch are all in flight at once, but only one batch per worker:
+// a tree of small directories keeps the ring nearly empty, and the depth
+// comes from -j rather than from batching several directories together.
+#define STAT_BATCH 256
+
+struct entry {
+    const char *name;
+    unsigned char dt;
+    signed char verdict;    // expression result, -1 until stat'ed
+    unsigned char need_stat, prune;
+    size_t snap_dt;         // -I: where its type byte went in the new snapshot
+    int err;                // errno from the stat, 0 if it worked
+    struct stat sb;
+#ifdef __linux__
+    struct statx stx;       // io_uring fills this in
+#endif
+};
+
+#ifdef __linux__
+// A bare io_uring, one per walker thread, used only for IORING_OP_STATX.
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = (int)syscall(__NR_io_uring_setup, STAT_BATCH, &p);
+    if (fd < 0) return -1;
+
+    // 5.1-5.5 have io_uring but no STATX; they also lack the probe, so a
+    // failed probe means the stat pool
+    size_t plen = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = xmalloc(plen);
+    memset(probe, 0, plen);
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->ops_len > IORING_OP_STATX &&
+             (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_len > sq_len) sq_len = cq_len;
+
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd); // the mappings (if any) just stay around, this only happens once
+        return -1;
+    }
+
+    u->fd = fd;
+    u->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sqes     = sqes;
+    return 0;
+}
+
+static void statx_to_stat(const struct statx *x, struct stat *sb) {
+    memset(sb, 0, sizeof *sb);
+    sb->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    sb->st_ino = x->stx_ino;
+    sb->st_mode = x->stx_mode;
+    sb->st_nlink = x->stx_nlink;
+    sb->st_uid = x->stx_uid;
+    sb->st_gid = x->stx_gid;
+    sb->st_rdev = makedev(x->stx_rdev_major, x->stx_rdev_minor);
+    sb->st_size = (off_t)x->stx_size;
+    sb->st_blksize = x->stx_blksize;
+    sb->st_blocks = (blkcnt_t)x->stx_blocks;
+    sb->st_atim.tv_sec = x->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = x->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+// statx every ents[i] with need_stat set, all submitted at once (n <= STAT_BATCH)
+static int uring_stat(struct uring *u, int dirfd, struct entry *ents, size_t n) {
+    unsigned tail = *u->sq_tail, mask = *u->sq_mask;
+    unsigned want = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!ents[i].need_stat) continue;
+        unsigned idx = tail & mask;
+        struct io_uring_sqe *sqe = &u->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)ents[i].name;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&ents[i].stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = i;
+        u->sq_array[idx] = idx;
+        tail++;
+        want++;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0, done = 0;
+    while (done < want) {
+        long r = syscall(__NR_io_uring_enter, u->fd, want - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            return -1;
+        }
+        submitted += (unsigned)r;
+
+        unsigned head = *u->cq_head;
+        unsigned ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++, done++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            struct entry *e = &ents[cqe->user_data];
+            e->err = (cqe->res < 0) ? -cqe->res : 0;
+            if (!e->err) statx_to_stat(&e->stx, &e->sb);
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+// -a without io_uring: a shared pool of threads doing fstatat, fed whole
+// batches. The walker thread waits for its batch to drain.
+#define STAT_THREADS 64
+
+struct statbatch {
+    int dirfd;
+    struct entry **ents;
+    size_t n, next, left;
+    pthread_cond_t done;
+    struct statbatch *link;
+};
+
+static pthread_mutex_t sp_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sp_cv = PTHREAD_COND_INITIALIZER;
+static struct statbatch *sp_head, *sp_tail;
+static pthread_once_t sp_once = PTHREAD_ONCE_INIT;
+
+static void *stat_pool_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&sp_mu);
+    for (;;) {
+        while (!sp_head) pthread_cond_wait(&sp_cv, &sp_mu);
+        struct statbatch *b = sp_head;
+        struct entry *e = b->ents[b->next++];
+        if (b->next == b->n) {
+            sp_head = b->link;
+            if (!sp_head) sp_tail = NULL;
+        }
+        pthread_mutex_unlock(&sp_mu);
+
+        e->err = fstatat(b->dirfd, e->name, &e->sb, AT_SYMLINK_NOFOLLOW) == -1 ? errno : 0;
+
+        pthread_mutex_lock(&sp_mu);
+        if (--b->left == 0) pthread_cond_signal(&b->done);
+    }
+    return NULL;
+}
+
+static void start_stat_pool(void) {
+    for (int i = 0; i < STAT_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, stat_pool_main, NULL) != 0) {
+            if (i == 0) { perror("pthread_create"); exit(EXIT_FAILURE); }
+            break;
+        }
+        pthread_detach(tid);
+    }
+}
+
+static void pool_stat(int dirfd, struct entry **ents, size_t n) {
+    pthread_once(&sp_once, start_stat_pool);
+    struct statbatch b = { dirfd, ents, n, 0, n, PTHREAD_COND_INITIALIZER, NULL };
+    pthread_mutex_lock(&sp_mu);
+    if (sp_tail) sp_tail->link = &b; else sp_head = &b;
+    sp_tail = &b;
+    pthread_cond_broadcast(&sp_cv);
+    while (b.left > 0) pthread_cond_wait(&b.done, &sp_mu);
+    pthread_mutex_unlock(&sp_mu);
+    pthread_cond_destroy(&b.done);
+}
+
+struct durec {
+    struct dusum s;
+    char *path;
+};
+
+struct duheap {
+    struct durec *v;
+    size_t n, cap;
+};
+
+struct worker {
+    pthread_t tid;
+    int id;
+    struct deque dq;
+    struct outnode out;     // -u mode output buffer
+    char *dentbuf;          // DENT_BUF bytes for dr_next
+    char *pathbuf;          // full path of the entry being printed
+    size_t pathcap;
+    struct entry *ents;     // STAT_BATCH of them
+    struct entry **statq;   // -a pool mode: the ones that need a stat
+#ifdef __linux__
+    struct uring ring;
+    int ring_state;         // 0 not tried yet, 1 up, -1 unavailable
+#endif
+    struct snapwriter snap; // -I: directories read by this worker
+    struct duheap top;      // -T: this worker's largest directories
+};
+
+// -D: disk usage per directory instead of a listing, like du. Each counted
+// entry adds to the dnode of the directory it's in, a directory counts its
+// own inode too. When a dnode's last reference goes, its whole subtree is
+// done, so its totals get printed and folded into the parent. In ordered
+// mode the line goes to a node spliced in after the children's lines,
+// which gives du's order; -T N keeps only the N largest, per thread until
+// the end. Files with more than one link are counted once.
+static __thread struct worker *this_worker;
+
+#define INO_SHARDS 64
+
+static struct inoshard {
+    pthread_mutex_t mu;
+    struct inokey { uint64_t dev, ino; int used; } *v;
+    size_t n, mask;
+} ino_seen[INO_SHARDS];
+
+// true the first time a (dev, ino) is seen
+static int first_link(const struct stat *sb) {
+    uint64_t dev = (uint64_t)sb->st_dev, ino = (uint64_t)sb->st_ino;
+    uint64_t h = (ino * 0x9E3779B97F4A7C15ull) ^ (dev * 0xC2B2AE3D27D4EB4Full);
+    struct inoshard *s = &ino_seen[(h >> 58) % INO_SHARDS];
+    int fresh = 1;
+    pthread_mutex_lock(&s->mu);
+    if ((s->n + 1) * 2 > s->mask + 1 || !s->v) {
+        size_t slots = s->v ? (s->mask + 1) * 2 : 64;
+        struct inokey *nv = xmalloc(slots * sizeof *nv);
+        memset(nv, 0, slots * sizeof *nv);
+        for (size_t i = 0; s->v && i <= s->mask; i++) {
+            if (!s->v[i].used) continue;
+            uint64_t k = (s->v[i].ino * 0x9E3779B97F4A7C15ull) ^ (s->v[i].dev * 0xC2B2AE3D27D4EB4Full);
+            size_t j = k & (slots - 1);
+            while (nv[j].used) j = (j + 1) & (slots - 1);
+            nv[j] = s->v[i];
+        }
+        free(s->v);
+        s->v = nv;
+        s->mask = slots - 1;
+    }
+    size_t i = h & s->mask;
+    while (s->v[i].used) {
+        if (s->v[i].dev == dev && s->v[i].ino == ino) { fresh = 0; break; }
+        i = (i + 1) & s->mask;
+    }
+    if (fresh) {
+        s->v[i].dev = dev;
+        s->v[i].ino = ino;
+        s->v[i].used = 1;
+        s->n++;
+    }
+    pthread_mutex_unlock(&s->mu);
+    return fresh;
+}
+
+static void du_count(struct dusum *sum, const struct stat *sb) {
+    if (!S_ISDIR(sb->st_mode) && sb->st_nlink > 1 && !first_link(sb)) return;
+    sum->blocks += (uint64_t)sb->st_blocks;
+    sum->bytes += (uint64_t)sb->st_size;
+    if (!S_ISDIR(sb->st_mode)) sum->files++;
+}
+
+static void du_add(struct dusum *to, const struct dusum *s) {
+    __atomic_add_fetch(&to->blocks, s->blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->bytes, s->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->files, s->files, __ATOMIC_RELAXED);
+}
+
+// "KiB<TAB>path", or with -l "KiB<TAB>bytes<TAB>files<TAB>path"
+static void du_line(struct outnode *o, const struct dusum *s, const char *path) {
+    out_u64(o, (s->blocks + 1) / 2);    // st_blocks are 512 bytes
+    out_char(o, '\t');
+    if (flag_long) {
+        out_u64(o, s->bytes);
+        out_char(o, '\t');
+        out_u64(o, s->files);
+        out_char(o, '\t');
+    }
+    out_puts(o, path);
+    out_char(o, record_end);
+}
+
+// -T: a min-heap on blocks, at most du_top long
+static void top_push(struct duheap *hp, const struct dusum *s, const char *path) {
+    struct durec r = { *s, NULL };
+    size_t i;
+    if (hp->n < (size_t)du_top) {
+        if (hp->n == hp->cap) {
+            hp->cap = hp->cap ? hp->cap * 2 : 16;
+            hp->v = xrealloc(hp->v, hp->cap * sizeof *hp->v);
+        }
+        i = hp->n++;
+        while (i > 0 && hp->v[(i - 1) / 2].s.blocks > s->blocks) {
+            hp->v[i] = hp->v[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        if (s->blocks <= hp->v[0].s.blocks) return;
+        free(hp->v[0].path);
+        i = 0;
+        for (;;) {
+            size_t c = 2 * i + 1;
+            if (c >= hp->n) break;
+            if (c + 1 < hp->n && hp->v[c + 1].s.blocks < hp->v[c].s.blocks) c++;
+            if (hp->v[c].s.blocks >= s->blocks) break;
+            hp->v[i] = hp->v[c];
+            i = c;
+        }
+    }
+    r.path = strdup(path);
+    if (!r.path) { perror("strdup"); exit(EXIT_FAILURE); }
+    hp->v[i] = r;
+}
+
+// called by dn_put as d is released
+static void du_release(struct dnode *d) {
+    struct dusum s;
+    s.blocks = __atomic_load_n(&d->du.blocks, __ATOMIC_RELAXED);
+    s.bytes = __atomic_load_n(&d->du.bytes, __ATOMIC_RELAXED);
+    s.files = __atomic_load_n(&d->du.files, __ATOMIC_RELAXED);
+    if (d->parent) du_add(&d->parent->du, &s);
+
+    if (du_top) {
+        top_push(&this_worker->top, &s, d->path);
+    } else if (d->du_tail) {
+        du_line(d->du_tail, &s, d->path);
+        node_finish(d->du_tail);
+    } else {
+        du_line(&this_worker->out, &s, d->path);
+    }
+}
+
+static int durec_order(const void *a, const void *b) {
+    const struct durec *x = a, *y = b;
+    if (x->s.blocks != y->s.blocks) return x->s.blocks > y->s.blocks ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+
+// Fill in sb/err for the entries that need_stat.
+static void stat_entries(struct worker *w, int dirfd, struct entry *ents, size_t n) {
+    if (flag_async) {
+#ifdef __linux__
+        if (w->ring_state == 0) w->ring_state = uring_init(&w->ring) == 0 ? 1 : -1;
+        if (w->ring_state > 0) {
+            if (uring_stat(&w->ring, dirfd, ents, n) == 0) return;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+#endif
+        size_t k = 0;
+        for (size_t i = 0; i < n; i++) if (ents[i].need_stat) w->statq[k++] = &ents[i];
+        if (k > 1) { pool_stat(dirfd, w->statq, k); return; }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!ents[i].need_stat) continue;
+        ents[i].err = fstatat(dirfd, ents[i].name, &ents[i].sb, AT_SYMLINK_NOFOLLOW) == -1 ? errno : 0;
+    }
+}
+
+static struct worker *workers;
+static int nworkers = 0;     // -j
+#define MAX_WORKERS 1024
+
+// Directories queued or being read; the walk is over when it hits 0.
+// Idle workers sleep on work_cv; work_gen changes whenever there may be
+// something new to steal, or the walk has ended.
+static long pending = 0;
+static int idlers = 0;
+static unsigned long work_gen = 0;
+static pthread_mutex_t work_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+
+static void wake_idlers(int all) {
+    pthread_mutex_lock(&work_mu);
+    work_gen++;
+    if (all) pthread_cond_broadcast(&work_cv);
+    else pthread_cond_signal(&work_cv);
+    pthread_mutex_unlock(&work_mu);
+}
+
+#define OUT_FLUSH (1024 * 1024)
+
+static const char *entry_path(struct worker *w, const struct dnode *d, const char *name) {
+    size_t nlen = strlen(name);
+    size_t need = d->pathlen + 1 + nlen + 1;
+    if (need > w->pathcap) {
+        w->pathcap = need * 2;
+        w->pathbuf = xrealloc(w->pathbuf, w->pathcap);
+    }
+    memcpy(w->pathbuf, d->path, d->pathlen);
+    w->pathbuf[d->pathlen] = '/';
+    memcpy(w->pathbuf + d->pathlen + 1, name, nlen + 1);
+    return w->pathbuf;
+}
+
+// Read one directory: print its entries and queue its subdirectories.
+static void explore_directory(struct worker *w, struct dirtask *t) {
+    struct outnode *o = t->out ? t->out : &w->out;
+    struct dnode *d = t->dn;
+    const char *dirpath = d->path;
+    struct dirtask **subdirs = NULL;
+    size_t nsub = 0, subcap = 0;
+
+    // entries are stat'ed relative to the directory fd, and only when
+    // something needs the stat data
+    if (!w->dentbuf) {
+        w->dentbuf = xmalloc(DENT_BUF);
+        w->ents = xmalloc(STAT_BATCH * sizeof *w->ents);
+        w->statq = xmalloc(STAT_BATCH * sizeof *w->statq);
+    }
+    struct dirreader dr;
+    int owned = 0;
+    int dfd = dn_open(d, &owned);
+
+    // -I: the old listing is good if the directory's mtime hasn't moved
+    struct stat dst;
+    const struct snap_dir *sd = NULL;
+    int have_dst = (index_path || flag_du) && dfd >= 0 && fstat(dfd, &dst) == 0;
+    int record = index_path && have_dst;
+    size_t rec_off = w->snap.elen;
+    uint64_t rec_n = 0;
+    if (record) sd = snap_find(&dst);
+
+    struct dusum sum = { 0, 0, 0 };
+    if (flag_du && d->du_self && have_dst) du_count(&sum, &dst);
+
+    if (sd) dr_open_snap(&dr, sd);
+    if (!sd && (dfd < 0 || dr_open(&dr, dfd, w->dentbuf) < 0)) {
+        fprintf(stderr, "Warning: Unable to open directory '%s': %s\n", dirpath, strerror(errno));
+    } else {
+        int r;
+        do {
+            // collect a batch, stopping early if the next read would
+            // overwrite the names we're holding
+            size_t n = 0;
+            const char *name;
+            unsigned char dt;
+            while (n < STAT_BATCH && (r = dr_next(&dr, &name, &dt)) > 0) {
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+                if (invalid_component(name)) continue;
+                size_t snap_dt = record ? snap_add_entry(&w->snap, dt, name) : 0;
+                rec_n++;
+
+                // first try the expression with only the name and d_type
+                struct evalctx c = { name, NULL, dt, NULL, 0 };
+                if (expr_uses_path) c.path = entry_path(w, d, name);
+                int verdict = eval_entry(&c);
+                // -D counts a directory when it's read, unless it won't be
+                int need_stat = dt == DT_UNKNOWN || verdict < 0 || (verdict > 0 && flag_long) ||
+                                (verdict > 0 && flag_du && (dt != DT_DIR || c.prune)) ||
+                                (flag_xdev && dt == DT_DIR);
+                if (verdict != 0 || dt == DT_DIR || need_stat) {
+                    struct entry *e = &w->ents[n++];
+                    e->name = name;
+                    e->dt = dt;
+                    e->verdict = (signed char)verdict;
+                    e->need_stat = (unsigned char)need_stat;
+                    e->prune = (unsigned char)c.prune;
+                    e->snap_dt = snap_dt;
+                    e->err = 0;
+                }
+                if (!dr_more(&dr)) break;
             }
-            explore_directory(fullpath);
+
+            stat_entries(w, dfd, w->ents, n);
+
+            for (size_t i = 0; i < n; i++) {
+                struct entry *e = &w->ents[i];
+                const char *fullpath = entry_path(w, d, e->name);
+
+                int is_dir = (e->dt == DT_DIR);
+                if (e->need_stat) {
+                    if (e->err) {
+                        fprintf(stderr, "Warning: lstat failed for '%s': %s\n", fullpath, strerror(e->err));
+                        continue;
+                    }
+                    is_dir = S_ISDIR(e->sb.st_mode);
+                    // the type can't change without the directory's mtime changing
+                    if (record && e->dt == DT_UNKNOWN)
+                        w->snap.ents[e->snap_dt] = (char)IFTODT(e->sb.st_mode);
+                    if (e->verdict < 0) {
+                        struct evalctx c = { e->name, fullpath, e->dt, &e->sb, 0 };
+                        e->verdict = (signed char)eval_entry(&c);
+                        e->prune = (unsigned char)c.prune;
+                    }
+                }
+
+                if (e->verdict > 0) {
+                    if (!flag_du) visit_node(o, dfd, e->name, fullpath, &e->sb);
+                    else if (!is_dir || e->prune) du_count(&sum, &e->sb);
+                }
+
+                if (is_dir && !e->prune) {
+                    if (flag_xdev && start_dev != (dev_t)-1 && e->sb.st_dev != start_dev) {
+                        continue; // don’t cross to another device
+                    }
+                    struct dirtask *sub = xmalloc(sizeof *sub);
+                    sub->dn = dn_new(d, e->name);
+                    sub->dn->du_self = (e->verdict > 0);
+                    sub->out = NULL;
+                    if (!flag_unordered) {
+                        sub->out = node_new();
+                        out_splice(o, sub->out);
+                    }
+                    if (nsub == subcap) {
+                        subcap = subcap ? subcap * 2 : 16;
+                        subdirs = xrealloc(subdirs, subcap * sizeof *subdirs);
+                    }
+                    subdirs[nsub++] = sub;
+                }
+            }
+            if (flag_unordered && o->len >= OUT_FLUSH) out_flush(o);
+        } while (r > 0);
+        if (r < 0) fprintf(stderr, "Warning: error reading directory '%s': %s\n", dirpath, strerror(errno));
+        dr_close(&dr);
+        if (record && r == 0) snap_add_dir(&w->snap, &dst, rec_off, rec_n);
+        else if (record) w->snap.elen = rec_off;    // partial listing, drop it
+    }
+    // children openat from here, so hang on to the fd if we can
+    if (dfd >= 0 && owned && nsub) dfd = dn_cache(d, dfd, &owned);
+    if (dfd >= 0 && owned) close(dfd);
+
+    if (flag_du) {
+        du_add(&d->du, &sum);
+        if (!flag_unordered && !du_top) {
+            d->du_tail = node_new();
+            out_splice(o, d->du_tail);
         }
     }
-    closedir(dp);
+    // -u output stays in the worker's buffer until it's OUT_FLUSH big
+    if (!flag_unordered) node_finish(o);
+
+    // reversed, so the first subdirectory is the next one popped
+    if (nsub) {
+        __atomic_add_fetch(&pending, (long)nsub, __ATOMIC_SEQ_CST);
+        while (nsub > 0) deque_push(&w->dq, subdirs[--nsub]);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&idlers, __ATOMIC_SEQ_CST) > 0) wake_idlers(0);
+    }
+    free(subdirs);
+    dn_put(d);
+    free(t);
+
+    if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) wake_idlers(1);
+}
+
+static struct dirtask *find_work(struct worker *w) {
+    struct dirtask *t = deque_pop(&w->dq);
+    for (int i = 1; !t && i < nworkers; i++) {
+        t = deque_steal(&workers[(w->id + i) % nworkers].dq);
+    }
+    return t;
+}
+
+static void *walker_main(void *arg) {
+    struct worker *w = arg;
+    this_worker = w;
+    for (;;) {
+        struct dirtask *t = find_work(w);
+        if (t) { explore_directory(w, t); continue; }
+
+        // announce we're idle, then look once more before sleeping, so a
+        // push that didn't see us idle is still found
+        pthread_mutex_lock(&work_mu);
+        __atomic_add_fetch(&idlers, 1, __ATOMIC_SEQ_CST);
+        unsigned long gen = work_gen;
+        pthread_mutex_unlock(&work_mu);
+
+        t = find_work(w);
+        pthread_mutex_lock(&work_mu);
+        while (!t && gen == work_gen && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) > 0)
+            pthread_cond_wait(&work_cv, &work_mu);
+        __atomic_sub_fetch(&idlers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&work_mu);
+
+        if (t) explore_directory(w, t);
+        else if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) break;
+    }
+    if (flag_unordered) out_flush(&w->out);     // whatever -u output is left
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l] [-x] [-u] [-a] [-0] [-j threads] [-I index] [-D] [-T count] [-n pattern]... [-N pattern_file] [starting_path] [expression]\n"
+                    "expression: -name PAT -regex ERE -type [fdlbcps] -size [+-]N[cbkMG] -mtime [+-]N\n"
+                    "            -newer FILE -user NAME|UID -prune -true ( ) ! -not -a -and -o -or\n"
+                    "            (-regex is POSIX extended syntax, not find's default emacs syntax)\n", prog);
+}
+
+// A whole number from 1 to max for -j/-T, or -1
+static long parse_count(const char *s, long max) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno || v < 1 || v > max) return -1;
+    return v;
 }
 
 int main(int argc, char *argv[]) {
@@ -177,21 +2288,59 @@ int main(int argc, char *argv[]) {
 
     const char *startpath = ".";
 
+    // options and the starting path come before the expression, so -a
+    // there is still the async flag while -a inside it means "and"
+    int nopts = 1;
+    while (nopts < argc && !starts_expr(argv[nopts])) nopts++;
+
     int opt;
-    while ((opt = getopt(argc, argv, "lxn:")) != -1) {
+    while ((opt = getopt(nopts, argv, "lxn:N:j:ua0I:DT:")) != -1) {
         switch (opt) {
             case 'l': flag_long = 1; break;
             case 'x': flag_xdev = 1; break;
-            case 'n': name_pat = optarg; break;
+            case 'n':
+                name_pats = xrealloc(name_pats, (size_t)(nname_pats + 1) * sizeof *name_pats);
+                name_pats[nname_pats++] = optarg;
+                break;
+            case 'N': read_patterns(optarg, &name_pats, &nname_pats); break;
+            case 'j':
+                if ((nworkers = (int)parse_count(optarg, MAX_WORKERS)) < 0) {
+                    fprintf(stderr, "Error: -j wants 1 to %d threads, not '%s'\n", MAX_WORKERS, optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u': flag_unordered = 1; break;
+            case 'a': flag_async = 1; break;
+            case '0': record_end = '\0'; break;
+            case 'I': index_path = optarg; break;
+            case 'D': flag_du = 1; break;
+            case 'T':
+                flag_du = 1;
+                if ((du_top = parse_count(optarg, LONG_MAX)) < 0) {
+                    fprintf(stderr, "Error: -T wants a count of at least 1, not '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-l] [-x] [-n pattern] [starting_path]\n", argv[0]);
+                usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    if (optind < argc) {
+    if (optind < nopts) {
         startpath = argv[optind];
     }
+    now_time = time(NULL);
+    if (nopts < argc) expr = parse_expr(argc - nopts, argv + nopts);
+    if (nname_pats) names = globset_build(name_pats, nname_pats);
+    if (index_path) snap_load(index_path);
+
+    if (nworkers <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = (n > 0) ? (int)n : 1;
+    }
 
     if (flag_xdev) {
         struct stat s0;
@@ -208,21 +2357,124 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    char startbuf[PATH_MAX];
-    if (snprintf(startbuf, sizeof startbuf, "%s", startpath) >= (int)sizeof startbuf) {
-        fprintf(stderr, "Error: starting path too long\n");
-        return EXIT_FAILURE;
+    // cached directory fds are capped by the fd limit, raised as far as allowed
+    struct rlimit rl;
+    long nofile = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        if (rl.rlim_cur < rl.rlim_max) {
+            rlim_t old = rl.rlim_cur;
+            rl.rlim_cur = rl.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rl) != 0) rl.rlim_cur = old;
+        }
+        if (rl.rlim_cur != RLIM_INFINITY) nofile = (long)rl.rlim_cur;
+        else nofile = 1L << 20;
+    }
+    fd_budget = nofile - 64 - 4L * nworkers; // each worker has a few fds of its own open
+    if (fd_budget < 0) fd_budget = 0;
+
+    workers = xmalloc((size_t)nworkers * sizeof *workers);
+    memset(workers, 0, (size_t)nworkers * sizeof *workers);
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].dq.mu, NULL);
+    }
+
+    struct outnode *root = node_new();
+    root->done = 1;
+
+    const char *base = strrchr(startpath, '/');
+    base = base ? base + 1 : startpath;
+    struct evalctx rc = { base, startpath, DT_UNKNOWN, &sb, 0 };
+    int root_ok = eval_entry(&rc);
+    int walk = S_ISDIR(sb.st_mode) && !rc.prune;
+    if (flag_du) {
+        for (int i = 0; i < INO_SHARDS; i++) pthread_mutex_init(&ino_seen[i].mu, NULL);
+        if (!walk && root_ok > 0) {
+            struct dusum s0 = { 0, 0, 0 };
+            du_count(&s0, &sb);
+            du_line(root, &s0, startpath);
+        }
+    } else if (!invalid_component(base) && root_ok > 0) {
+        visit_node(root, AT_FDCWD, startpath, startpath, &sb);
+    }
+
+    if (walk) {
+        struct dirtask *t = xmalloc(sizeof *t);
+        t->dn = dn_new(NULL, startpath);
+        t->dn->du_self = (root_ok > 0);
+        t->out = NULL;
+        if (!flag_unordered) {
+            t->out = node_new();
+            out_splice(root, t->out);
+        }
+        pending = 1;
+        deque_push(&workers[0].dq, t);
     }
 
-    const char *base = strrchr(startbuf, '/');
-    base = base ? base + 1 : startbuf;
-    if (!invalid_component(base)) {
-        visit_node("", base, startbuf, &sb);
+    if (flag_unordered) {
+        out_flush(root);
+        free(root->buf);
+        free(root);
     }
 
-    if (S_ISDIR(sb.st_mode)) {
-        explore_directory(startbuf);
+    int started = 0;
+    if (pending) {
+        for (; started < nworkers; started++) {
+            if (pthread_create(&workers[started].tid, NULL, walker_main, &workers[started]) != 0) {
+                if (started == 0) { perror("pthread_create"); return EXIT_FAILURE; }
+                break; // walk with the ones we got, the rest just have empty deques
+            }
+        }
+    }
+
+    if (!flag_unordered) print_tree(root);
+
+    for (int i = 0; i < started; i++) pthread_join(workers[i].tid, NULL);
+
+    int status = EXIT_SUCCESS;
+    if (du_top) {
+        // each worker kept its own top N; the overall ones are among them
+        size_t total = 0;
+        for (int i = 0; i < nworkers; i++) total += workers[i].top.n;
+        struct durec *all = xmalloc((total ? total : 1) * sizeof *all);
+        total = 0;
+        for (int i = 0; i < nworkers; i++) {
+            memcpy(all + total, workers[i].top.v, workers[i].top.n * sizeof *all);
+            total += workers[i].top.n;
+            free(workers[i].top.v);
+        }
+        qsort(all, total, sizeof *all, durec_order);
+        struct outnode *top = node_new();
+        for (size_t i = 0; i < total; i++) {
+            if (i < (size_t)du_top) du_line(top, &all[i].s, all[i].path);
+            free(all[i].path);
+        }
+        out_flush(top);
+        free(top->buf);
+        free(top);
+        free(all);
+    }
+    if (index_path) {
+        struct snapwriter **sws = xmalloc((size_t)nworkers * sizeof *sws);
+        for (int i = 0; i < nworkers; i++) sws[i] = &workers[i].snap;
+        if (snap_save(index_path, sws, nworkers) != 0) status = EXIT_FAILURE;
+        for (int i = 0; i < nworkers; i++) {
+            free(sws[i]->dirs);
+            free(sws[i]->ents);
+        }
+        free(sws);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        free(workers[i].out.buf);
+        free(workers[i].dentbuf);
+        free(workers[i].pathbuf);
+        free(workers[i].ents);
+        free(workers[i].statq);
     }
 
-    return EXIT_SUCCESS;
+    if (out_error) {
+        fprintf(stderr, "Error: writing output: %s\n", strerror(out_error));
+        return EXIT_FAILURE;
+    }
+    return status;
 }